@@ -0,0 +1,35 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "bstat.h"
+#include "istat.h"
+
+// Print the buffer cache and inode cache counters.
+int
+main(int argc, char *argv[])
+{
+  struct bstat st;
+  struct istat ist;
+
+  if(bstat(&st) < 0){
+    printf(2, "bcstat: bstat failed\n");
+    exit();
+  }
+  printf(1, "buffers:   %d\n", st.nbuf);
+  printf(1, "hits:      %d\n", st.hits);
+  printf(1, "misses:    %d\n", st.misses);
+  printf(1, "evictions: %d\n", st.evictions);
+  printf(1, "grows:     %d\n", st.grows);
+  printf(1, "shrinks:   %d\n", st.shrinks);
+
+  if(istat(&ist) < 0){
+    printf(2, "bcstat: istat failed\n");
+    exit();
+  }
+  printf(1, "inodes:    %d\n", ist.ninode);
+  printf(1, "hits:      %d\n", ist.hits);
+  printf(1, "misses:    %d\n", ist.misses);
+  printf(1, "reclaims:  %d\n", ist.reclaims);
+  printf(1, "grows:     %d\n", ist.grows);
+  exit();
+}
@@ -1,6 +1,6 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
@@ -17,42 +17,152 @@
 // * B_VALID: the buffer data has been read from the disk.
 // * B_DIRTY: the buffer data has been modified
 //     and needs to be written to disk.
+//
+// Locking: each hash bucket's lock protects its chain and the
+// refcnt of the buffers on it.  lrulock protects the free list
+// and is always taken last.  Recycling a buffer moves it between
+// two buckets, so recyclers serialize on bcache.lock first; that
+// way no two processes ever wait on each other's bucket locks.
+//
+// The cache starts with NBUF buffers and grows a page of buffers
+// at a time, up to NBUFMAX, while kalloc has plenty of free pages.
+// When kalloc runs dry it calls bshrink to take back pages whose
+// buffers are all idle.
 
 #include "types.h"
 #include "defs.h"
 #include "param.h"
+#include "mmu.h"
 #include "spinlock.h"
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "bstat.h"
 
-struct {
+#if BSIZE > PGSIZE || PGSIZE % BSIZE != 0
+#error "BSIZE must divide PGSIZE"
+#endif
+
+#define NBUCKET   13
+#define BPERPG    (PGSIZE/BSIZE)  // buffers sharing one data page
+#define NBPAGE    (NBUFMAX/BPERPG)
+#define BMINFREE  1024            // grow only while kalloc has this many pages
+#define BSHRINK   8               // max pages one bshrink call returns
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;  // chained through hnext
+};
+
+struct {
+  struct spinlock lock;     // held while recycling a buffer
+  struct spinlock lrulock;
+  struct spinlock iolock;   // B_ASYNC completion and bwait
+  struct buf buf[NBUFMAX];
+  char *page[NBPAGE];       // data of buf[i] is in page[i/BPERPG]
+  int nbuf;
+  struct bstat stat;
+  struct bucket bucket[NBUCKET];
 
-  // Linked list of all buffers, through prev/next.
+  // Free list: buffers with refcnt 0, through prev/next.
   // head.next is most recently used.
   struct buf head;
 } bcache;
 
+static void bunref(struct buf*);
+
+static struct bucket*
+bhash(uint dev, uint blockno)
+{
+  return &bcache.bucket[(dev*31 + blockno) % NBUCKET];
+}
+
+// Add a page worth of buffers to the cache, at the cold end
+// of the free list so they are recycled first.
+static void
+bgrow(void)
+{
+  struct buf *b;
+  char *mem;
+  int g, i;
+
+  if((mem = kalloc()) == 0)
+    return;
+  acquire(&bcache.lock);
+  for(g = 0; g < NBPAGE; g++)
+    if(bcache.page[g] == 0)
+      break;
+  if(g == NBPAGE){
+    release(&bcache.lock);
+    kfree(mem);
+    return;
+  }
+  bcache.page[g] = mem;
+  acquire(&bcache.lrulock);
+  for(i = 0; i < BPERPG; i++){
+    b = &bcache.buf[g*BPERPG + i];
+    b->data = (uchar*)mem + i*BSIZE;
+    b->dev = 0;
+    b->blockno = 0;
+    b->flags = 0;
+    b->refcnt = 0;
+    b->prev = bcache.head.prev;
+    b->next = &bcache.head;
+    bcache.head.prev->next = b;
+    bcache.head.prev = b;
+  }
+  release(&bcache.lrulock);
+  bcache.nbuf += BPERPG;
+  bcache.stat.grows++;
+  release(&bcache.lock);
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  struct bucket *bk;
 
   initlock(&bcache.lock, "bcache");
+  initlock(&bcache.lrulock, "bcache.lru");
+  initlock(&bcache.iolock, "bcache.io");
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  for(b = bcache.buf; b < bcache.buf+NBUFMAX; b++)
+    initsleeplock(&b->lock, "buffer");
 
 //PAGEBREAK!
-  // Create linked list of buffers
+  // Start with NBUF buffers on the free list.  Fresh
+  // buffers are on no hash chain.
   bcache.head.prev = &bcache.head;
   bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  while(bcache.nbuf < NBUF){
+    bgrow();
+    if(bcache.stat.grows == 0)
+      panic("binit");
+  }
+  bcache.stat.grows = 0;
+}
+
+// Look for a cached block in bucket bk and take a reference.
+// Caller must hold bk->lock.
+static struct buf*
+bfind(struct bucket *bk, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->blockno == blockno){
+      if(b->refcnt++ == 0){
+        acquire(&bcache.lrulock);
+        b->next->prev = b->prev;
+        b->prev->next = b->next;
+        release(&bcache.lrulock);
+      }
+      return b;
+    }
   }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
@@ -61,35 +171,84 @@ binit(void)
 static struct buf*
 bget(uint dev, uint blockno)
 {
-  struct buf *b;
+  struct buf *b, **pp;
+  struct bucket *bk, *obk;
+
+  bk = bhash(dev, blockno);
+  acquire(&bk->lock);
+  b = bfind(bk, dev, blockno);
+  release(&bk->lock);
+  if(b){
+    __sync_fetch_and_add(&bcache.stat.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
 
+  if(bcache.nbuf < NBUFMAX && kfreepages() > BMINFREE)
+    bgrow();
+
+  // Not cached; recycle an unused buffer.  Check again once
+  // recycling is serialized: another process may have just
+  // brought the same block in.
   acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if((b = bfind(bk, dev, blockno)) != 0){
+    release(&bk->lock);
+    release(&bcache.lock);
+    __sync_fetch_and_add(&bcache.stat.hits, 1);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  bcache.stat.misses++;
 
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  for(;;){
+    // Even if refcnt==0, B_DIRTY indicates a buffer is in use
+    // because log.c has modified it but not yet committed it.
+    acquire(&bcache.lrulock);
+    for(b = bcache.head.prev; b != &bcache.head; b = b->prev)
+      if((b->flags & B_DIRTY) == 0)
+        break;
+    release(&bcache.lrulock);
+    if(b == &bcache.head)
+      panic("bget: no buffers");
+
+    // Only recyclers change a buffer's identity, so obk is stable;
+    // but b may have been looked up, and even logged and released,
+    // before we got its bucket.
+    obk = bhash(b->dev, b->blockno);
+    if(obk != bk)
+      acquire(&obk->lock);
+    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0)
+      break;
+    if(obk != bk)
+      release(&obk->lock);
   }
 
-  // Not cached; recycle an unused buffer.
-  // Even if refcnt==0, B_DIRTY indicates a buffer is in use
-  // because log.c has modified it but not yet committed it.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0 && (b->flags & B_DIRTY) == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->flags = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  acquire(&bcache.lrulock);
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+  release(&bcache.lrulock);
+  for(pp = &obk->head; *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      break;
     }
   }
-  panic("bget: no buffers");
+  if(obk != bk)
+    release(&obk->lock);
+
+  if(b->flags & B_VALID)
+    bcache.stat.evictions++;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->flags = 0;
+  b->refcnt = 1;
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -105,6 +264,18 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for a block the caller is going to
+// overwrite completely, without reading it from disk.
+struct buf*
+bclaim(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  b->flags |= B_VALID;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -115,30 +286,233 @@ bwrite(struct buf *b)
   iderw(b);
 }
 
+// Write n locked buffers to disk, merging runs of consecutive
+// blocks into single disk commands.
+void
+bwritev(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(!holdingsleep(&bv[i]->lock))
+      panic("bwritev");
+    bv[i]->flags |= B_DIRTY;
+  }
+  iderwv(bv, n);
+}
+
+// Bring blocks blockno..blockno+n-1 into the cache, reading the
+// missing ones together so the disk sees as few commands as possible.
+void
+bprefetch(uint dev, uint blockno, int n)
+{
+  struct buf *b, *bv[BPREFETCH];
+  int i, m;
+
+  for(; n > 0; n -= BPREFETCH, blockno += BPREFETCH){
+    m = 0;
+    for(i = 0; i < n && i < BPREFETCH; i++){
+      b = bget(dev, blockno + i);
+      if(b->flags & B_VALID)
+        brelse(b);
+      else
+        bv[m++] = b;
+    }
+    if(m > 0)
+      iderwv(bv, m);
+    for(i = 0; i < m; i++)
+      brelse(bv[i]);
+  }
+}
+
+// Start reading the n bufs in bv, which must be locked and not
+// valid, and return without waiting.  done, if not 0, is called
+// from the disk interrupt as each read finishes.
+static void
+bstartread(struct buf **bv, int n, void (*done)(struct buf*))
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    bv[i]->flags |= B_ASYNC;
+    bv[i]->done = done;
+  }
+  iderwv(bv, n);
+}
+
+// Return a locked buf for the indicated block, with its read
+// possibly still in flight.  Call bwait before using the data.
+struct buf*
+bread_async(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  if((b->flags & B_VALID) == 0)
+    bstartread(&b, 1, 0);
+  return b;
+}
+
+// Wait for the read started by bread_async to finish.
+void
+bwait(struct buf *b)
+{
+  acquire(&bcache.iolock);
+  while(b->flags & B_ASYNC)
+    sleep(b, &bcache.iolock);
+  release(&bcache.iolock);
+}
+
+// Completion callback for read-ahead: nobody owns the buffer,
+// so release it here.
+static void
+bunlock(struct buf *b)
+{
+  releasesleep(&b->lock);
+  bunref(b);
+}
+
+// Start reading blocks into the cache without waiting for them.
+// Each buffer is released when its read completes, and a later
+// bread of the block waits for that.
+void
+breadahead(uint dev, uint *blocks, int n)
+{
+  struct buf *b, *bv[NREADAHEAD];
+  int i, m;
+
+  m = 0;
+  for(i = 0; i < n; i++){
+    b = bget(dev, blocks[i]);
+    if(b->flags & B_VALID)
+      brelse(b);
+    else
+      bv[m++] = b;
+    if(m == NREADAHEAD || (i == n-1 && m > 0)){
+      bstartread(bv, m, bunlock);
+      m = 0;
+    }
+  }
+}
+
+// Called by the disk driver when a B_ASYNC transfer of b
+// finishes: wake bwait and run the completion callback.
+void
+bdone(struct buf *b)
+{
+  void (*done)(struct buf*);
+
+  acquire(&bcache.iolock);
+  b->flags &= ~B_ASYNC;
+  done = b->done;
+  b->done = 0;
+  wakeup(b);
+  release(&bcache.iolock);
+  if(done)
+    done(b);
+}
+
 // Release a locked buffer.
-// Move to the head of the MRU list.
+// Move to the head of the free list.
 void
 brelse(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("brelse");
+  if(b->flags & B_ASYNC)
+    bwait(b);
 
   releasesleep(&b->lock);
+  bunref(b);
+}
 
-  acquire(&bcache.lock);
+// Drop a reference to an unlocked buffer.
+static void
+bunref(struct buf *b)
+{
+  struct bucket *bk;
+
+  bk = bhash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
+    acquire(&bcache.lrulock);
     b->next = bcache.head.next;
     b->prev = &bcache.head;
     bcache.head.next->prev = b;
     bcache.head.next = b;
+    release(&bcache.lrulock);
   }
   
+  release(&bk->lock);
+}
+// Give pages of idle buffers back to kalloc, coldest first,
+// keeping at least NBUF buffers.  Called by kalloc when it has
+// no free pages left.  Returns the number of pages freed.
+int
+bshrink(void)
+{
+  struct bucket *bk;
+  struct buf *b, *x, **pp;
+  char *freed[BSHRINK];
+  int g, i, n;
+
+  n = 0;
+  acquire(&bcache.lock);
+  for(bk = bcache.bucket; bk < bcache.bucket+NBUCKET; bk++)
+    acquire(&bk->lock);
+  acquire(&bcache.lrulock);
+again:
+  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
+    if(n == BSHRINK || bcache.nbuf - BPERPG < NBUF)
+      break;
+    g = (b - bcache.buf) / BPERPG;
+    for(i = 0; i < BPERPG; i++){
+      x = &bcache.buf[g*BPERPG + i];
+      if(x->refcnt != 0 || (x->flags & B_DIRTY))
+        break;
+    }
+    if(i < BPERPG)
+      continue;
+    for(i = 0; i < BPERPG; i++){
+      x = &bcache.buf[g*BPERPG + i];
+      bk = bhash(x->dev, x->blockno);
+      for(pp = &bk->head; *pp; pp = &(*pp)->hnext){
+        if(*pp == x){
+          *pp = x->hnext;
+          break;
+        }
+      }
+      x->next->prev = x->prev;
+      x->prev->next = x->next;
+    }
+    freed[n++] = bcache.page[g];
+    bcache.page[g] = 0;
+    bcache.nbuf -= BPERPG;
+    bcache.stat.shrinks++;
+    goto again;
+  }
+  release(&bcache.lrulock);
+  for(bk = bcache.bucket+NBUCKET; bk > bcache.bucket; bk--)
+    release(&(bk-1)->lock);
   release(&bcache.lock);
+
+  for(i = 0; i < n; i++)
+    kfree(freed[i]);
+  return n;
 }
+
+// Copy the cache counters into *st.
+void
+bstat(struct bstat *st)
+{
+  acquire(&bcache.lock);
+  *st = bcache.stat;
+  st->nbuf = bcache.nbuf;
+  release(&bcache.lock);
+}
+
 //PAGEBREAK!
 // Blank page.
 
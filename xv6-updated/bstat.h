@@ -0,0 +1,9 @@
+// Buffer cache counters, returned by bstat().
+struct bstat {
+  uint nbuf;       // buffers currently in the cache
+  uint hits;
+  uint misses;
+  uint evictions;  // cached blocks recycled to hold another block
+  uint grows;      // pages added to the cache
+  uint shrinks;    // pages given back under memory pressure
+};
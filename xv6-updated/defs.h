@@ -1,7 +1,10 @@
+struct bstat;
+struct istat;
 struct buf;
 struct context;
 struct file;
 struct inode;
+struct pcidev;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -13,8 +16,17 @@ struct superblock;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bclaim(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwritev(struct buf**, int);
+void            bprefetch(uint, uint, int);
+struct buf*     bread_async(uint, uint);
+void            bwait(struct buf*);
+void            breadahead(uint, uint*, int);
+void            bdone(struct buf*);
+int             bshrink(void);
+void            bstat(struct bstat*);
 
 // console.c
 void            consoleinit(void);
@@ -36,14 +48,21 @@ int             filewrite(struct file*, char*, int n);
 
 // fs.c
 void            readsb(int dev, struct superblock *sb);
+void            dcenter(struct inode*, char*, uint);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
+void            icacheinit(void);
 struct inode*   idup(struct inode*);
 void            iinit(int dev);
 void            ilock(struct inode*);
+void            ilockshared(struct inode*);
+void            ilockread(struct inode*);
 void            iput(struct inode*);
+void            istat(struct istat*);
 void            iunlock(struct inode*);
+void            iunlockshared(struct inode*);
+void            iunlockread(struct inode*);
 void            iunlockput(struct inode*);
 void            iupdate(struct inode*);
 int             namecmp(const char*, const char*);
@@ -57,6 +76,7 @@ int             writei(struct inode*, char*, uint, uint);
 void            ideinit(void);
 void            ideintr(void);
 void            iderw(struct buf*);
+void            iderwv(struct buf**, int);
 
 // ioapic.c
 void            ioapicenable(int irq, int cpu);
@@ -69,6 +89,7 @@ void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
 void            krefpage(void*);
+int             kfreepages(void);
 int             kgetrefcount(void*);
 // kbd.c
 void            kbdintr(void);
@@ -85,13 +106,27 @@ void            microdelay(int);
 // log.c
 void            initlog(int dev);
 void            log_write(struct buf*);
+void            log_data(struct buf*);
+void            log_freed(uint);
+int             log_busy(uint);
+int             log_ordered(void);
 void            begin_op();
 void            end_op();
+void            begin_dataop(void);
+void            end_dataop(void);
+void            logsync(void);
+void            logflusher(void);
 
 // mp.c
 extern int      ismp;
 void            mpinit(void);
 
+// pci.c
+int             pcifind(struct pcidev*, uint, uint, uint, uint);
+void            pcienable(struct pcidev*, uint);
+uint            pciread(struct pcidev*, uint);
+void            pciwrite(struct pcidev*, uint, uint);
+
 // picirq.c
 void            picenable(int);
 void            picinit(void);
@@ -109,6 +144,7 @@ void            exit(void);
 int             fork(void);
 int             growproc(int);
 int             kill(int);
+void            kthread(char*, void (*)(void));
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
@@ -122,6 +158,7 @@ int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 int            demo(void); //demo added
+void            forkdiverged(struct proc*);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -138,6 +175,8 @@ void            popcli(void);
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
 void            releasesleep(struct sleeplock*);
+void            acquireshared(struct sleeplock*);
+void            releaseshared(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
@@ -172,6 +211,12 @@ void            uartinit(void);
 void            uartintr(void);
 void            uartputc(int);
 
+// virtio.c
+extern int      virtioirq;
+int             virtioinit(void);
+void            virtiointr(void);
+void            virtiorw(struct buf**, int);
+
 // vm.c
 void            seginit(void);
 void            kvmalloc(void);
@@ -182,7 +227,7 @@ int             deallocuvm(pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
-pde_t*          copyuvm(pde_t*, uint);
+pde_t*          copyuvm(pde_t*, uint, uint, int);
 void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
@@ -190,6 +235,9 @@ void            clearpteu(pde_t *pgdir, char *uva);
 int             countpages(pde_t*, int, int); // for the function call of "countpages" & "getmemstats"
 void            getmemstats(struct proc*, int*, int*, int*);
 int             cowhandler(pde_t*, uint);
+int             forkdirty(pde_t*);
+int             growstack(struct proc*, uint);
+int             touchstack(struct proc*, uint, uint);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
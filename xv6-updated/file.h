@@ -14,15 +14,24 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hnext; // hash chain
+  struct inode *prev;  // LRU list of unreferenced inodes
+  struct inode *next;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  // Read-ahead hints; readers holding the lock shared
+  // update them without further locking.
+  uint ranext;        // block after the last one read
+  uint raend;         // read-ahead has been started up to here
+  uint nextblk;       // where bmap next asks balloc to allocate
 
   short type;         // copy of disk inode
   short major;
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  struct extent ext[NEXTENT];
+  uint dindirect;
 };
 
 // table mapping major device number to
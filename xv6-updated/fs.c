@@ -20,9 +20,11 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "istat.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 static void itrunc(struct inode*);
+static void dcpurge(uint, uint);
 // there should be one superblock per disk device, but we run with
 // only one device
 struct superblock sb; 
@@ -38,43 +40,100 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
-// Zero a block.
+// Zero a block.  data says it will hold regular file data.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int data)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
+  bp = bclaim(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if(data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+#define NBMAP (FSSIZE/BPB + 1)
+
+// Summary of the free bitmap, so that balloc can pass over full
+// bitmap blocks without reading them.  nfree[g] is the number
+// of free blocks under bitmap block g, or -1 until the block is
+// first read; it only changes while that block's buffer is
+// locked.  rotor is just past the last block handed out.
+// Readers without the buffer treat both as hints.
+struct {
+  int nfree[NBMAP];
+  uint rotor;
+} freemap;
+
+// Find and mark in use a free block, looking first at goal and
+// then onwards, wrapping around.  Unless busyok, pass over blocks
+// that log.c says are busy.  Returns 0 if there is none.
 static uint
-balloc(uint dev)
+bfind(uint dev, uint goal, int busyok)
 {
-  int b, bi, m;
+  int g, g0, i, nb, bi, m, n;
+  uint b;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
+  nb = (sb.size + BPB - 1) / BPB;
+  g0 = goal / BPB;
+  for(i = 0; i <= nb; i++){  // revisit g0 for the bits before goal
+    g = (g0 + i) % nb;
+    if(freemap.nfree[g] == 0)
+      continue;
+    bp = bread(dev, BBLOCK(g*BPB, sb));
+    if(freemap.nfree[g] < 0){
+      n = 0;
+      for(bi = 0; bi < BPB && g*BPB + bi < sb.size; bi++)
+        if((bp->data[bi/8] & (1 << (bi % 8))) == 0)
+          n++;
+      freemap.nfree[g] = n;
+    }
+    for(bi = i == 0 ? goal % BPB : 0; bi < BPB; bi++){
+      b = g*BPB + bi;
+      if(b >= sb.size)
+        break;
+      if(bi % 8 == 0 && bp->data[bi/8] == 0xff){  // all 8 in use
+        bi += 7;
+        continue;
+      }
       m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
+      if((bp->data[bi/8] & m) == 0 &&  // Is block free?
+         (busyok || !log_busy(b))){
         bp->data[bi/8] |= m;  // Mark block in use.
+        freemap.nfree[g]--;
         log_write(bp);
         brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+        return b;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+  return 0;
+}
+
+// Allocate a zeroed disk block, as close after goal as possible;
+// a goal of 0 continues from the last new file.  data says it
+// will hold regular file data.  Busy blocks (see log.c) are only
+// handed out when there is nothing else.
+static uint
+balloc(uint dev, int data, uint goal)
+{
+  uint b;
+
+  if(goal == 0 || goal >= sb.size)
+    goal = freemap.rotor;
+  if((b = bfind(dev, goal, 0)) == 0 &&
+     (b = bfind(dev, goal, 1)) == 0)
+    panic("balloc: out of blocks");
+  freemap.rotor = b + 1;
+  bzero(dev, b, data);
+  return b;
 }
 
 // Free a disk block.
@@ -90,8 +149,11 @@ bfree(int dev, uint b)
   if((bp->data[bi/8] & m) == 0)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
+  if(freemap.nfree[b/BPB] >= 0)
+    freemap.nfree[b/BPB]++;
   log_write(bp);
   brelse(bp);
+  log_freed(b);
 }
 
 // Inodes.
@@ -158,26 +220,135 @@ bfree(int dev, uint b)
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
 // holds, one must hold icache.lock while using any of those fields.
+// It also protects the hash chains and the LRU list.
+//
+// The cache grows a page of inodes at a time, like the buffer
+// cache, while kalloc has memory to spare.  An inode whose ref
+// drops to 0 stays cached, valid, on an LRU list; iget finds it
+// again without reading its inode block, and otherwise recycles
+// the least recently used one.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 61
+#define IPERPG   (PGSIZE/sizeof(struct inode))
+#define IMINFREE 1024  // grow only while kalloc has this many pages
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *bucket[NIBUCKET];  // chained through hnext
+  int ninode;
+  struct istat stat;
+
+  // Unreferenced inodes, through prev/next.
+  // head.next is most recently used.
+  struct inode head;
 } icache;
 
+static struct inode**
+ihash(uint dev, uint inum)
+{
+  return &icache.bucket[(dev*31 + inum) % NIBUCKET];
+}
+
+// Add a page worth of inodes to the cache, at the cold end of
+// the LRU list, on no hash chain.  Caller must hold icache.lock.
+static void
+igrow(void)
+{
+  struct inode *ip;
+  char *mem;
+  int i;
+
+  if((mem = kalloc()) == 0)
+    return;
+  memset(mem, 0, PGSIZE);
+  for(i = 0; i < IPERPG; i++){
+    ip = (struct inode*)mem + i;
+    initsleeplock(&ip->lock, "inode");
+    ip->prev = icache.head.prev;
+    ip->next = &icache.head;
+    icache.head.prev->next = ip;
+    icache.head.prev = ip;
+  }
+  icache.ninode += IPERPG;
+  icache.stat.grows++;
+}
+
 void
-iinit(int dev)
+icacheinit(void)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  icache.head.prev = &icache.head;
+  icache.head.next = &icache.head;
+  acquire(&icache.lock);
+  while(icache.ninode < NINODE){
+    igrow();
+    if(icache.stat.grows == 0)
+      panic("icacheinit");
   }
+  icache.stat.grows = 0;
+  release(&icache.lock);
+}
+
+// Copy the cache counters into *st.
+void
+istat(struct istat *st)
+{
+  acquire(&icache.lock);
+  *st = icache.stat;
+  st->ninode = icache.ninode;
+  release(&icache.lock);
+}
+
+#define NINOBLK (NINODES/IPB + 1)
 
+// Summary of the inode blocks, so that ialloc can pass over
+// full ones without reading them.  nfree[g] is the number of
+// free inodes in inode block g, or -1 until ialloc next reads
+// it.  rotor is just past the last inode handed out.
+struct {
+  struct spinlock lock;
+  int nfree[NINOBLK];
+  uint rotor;
+} ifree;
+
+// Name cache: (directory, name) -> inum, where inum 0 records
+// that the name is absent.  An entry changes only while its
+// directory is locked, together with the directory's content,
+// so namex can follow cached names without locking or reading
+// each directory.  The cache is set-associative, DCWAYS entries
+// per set, replacing the least recently used.
+#define DCWAYS 4
+#define NDCSET (NDCACHE/DCWAYS)
+
+struct dcentry {
+  uint dev;
+  uint dir;           // inum of the directory; 0 if unused
+  uint inum;
+  uint used;          // dcache.clock at last use
+  char name[DIRSIZ];
+};
+
+struct {
+  struct spinlock lock;
+  uint clock;
+  struct dcentry e[NDCSET][DCWAYS];
+} dcache;
+
+void
+iinit(int dev)
+{
+  int i;
+
+  for(i = 0; i < NBMAP; i++)
+    freemap.nfree[i] = -1;
+  initlock(&ifree.lock, "ifree");
+  initlock(&dcache.lock, "dcache");
+  for(i = 0; i < NINOBLK; i++)
+    ifree.nfree[i] = -1;
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -194,21 +365,49 @@ static struct inode* iget(uint dev, uint inum);
 struct inode*
 ialloc(uint dev, short type)
 {
-  int inum;
+  int g, g0, i, j, nb, n, inum, found;
   struct buf *bp;
   struct dinode *dip;
 
-  for(inum = 1; inum < sb.ninodes; inum++){
-    bp = bread(dev, IBLOCK(inum, sb));
-    dip = (struct dinode*)bp->data + inum%IPB;
-    if(dip->type == 0){  // a free inode
+  nb = (sb.ninodes + IPB - 1) / IPB;
+  acquire(&ifree.lock);
+  g0 = ifree.rotor / IPB;
+  release(&ifree.lock);
+  for(i = 0; i < nb; i++){
+    g = (g0 + i) % nb;
+    acquire(&ifree.lock);
+    n = g < NINOBLK ? ifree.nfree[g] : -1;
+    release(&ifree.lock);
+    if(n == 0)
+      continue;
+    bp = bread(dev, IBLOCK(g*IPB, sb));
+    found = 0;
+    n = 0;
+    for(j = 0; j < IPB; j++){
+      inum = g*IPB + j;
+      dip = (struct dinode*)bp->data + j;
+      if(inum == 0 || inum >= sb.ninodes || dip->type != 0)
+        continue;
+      if(found == 0)
+        found = inum;   // a free inode
+      else
+        n++;
+    }
+    if(found){
+      dip = (struct dinode*)bp->data + found%IPB;
       memset(dip, 0, sizeof(*dip));
       dip->type = type;
       log_write(bp);   // mark it allocated on the disk
-      brelse(bp);
-      return iget(dev, inum);
     }
+    acquire(&ifree.lock);
+    if(g < NINOBLK)
+      ifree.nfree[g] = n;
+    if(found)
+      ifree.rotor = found + 1;
+    release(&ifree.lock);
     brelse(bp);
+    if(found)
+      return iget(dev, found);
   }
   panic("ialloc: no inodes");
 }
@@ -230,7 +429,8 @@ iupdate(struct inode *ip)
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
   dip->size = ip->size;
-  memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
+  memmove(dip->ext, ip->ext, sizeof(ip->ext));
+  dip->dindirect = ip->dindirect;
   log_write(bp);
   brelse(bp);
 }
@@ -241,31 +441,50 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip, **pp;
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = *ihash(dev, inum); ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        ip->next->prev = ip->prev;
+        ip->prev->next = ip->next;
+      }
+      icache.stat.hits++;
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
-
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  icache.stat.misses++;
+
+  // Recycle the least recently used unreferenced inode; grow
+  // the cache only when every inode is in use.
+  if(icache.head.prev == &icache.head &&
+     icache.ninode < NINODEMAX && kfreepages() > IMINFREE)
+    igrow();
+  ip = icache.head.prev;
+  if(ip == &icache.head)
     panic("iget: no inodes");
-
-  ip = empty;
+  ip->next->prev = ip->prev;
+  ip->prev->next = ip->next;
+  if(ip->dev != 0){
+    for(pp = ihash(ip->dev, ip->inum); *pp != ip; pp = &(*pp)->hnext)
+      ;
+    *pp = ip->hnext;
+    icache.stat.reclaims++;
+  }
+  pp = ihash(dev, inum);
+  ip->hnext = *pp;
+  *pp = ip;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->ranext = 0;
+  ip->raend = 0;
+  ip->nextblk = 0;
   release(&icache.lock);
 
   return ip;
@@ -303,7 +522,8 @@ ilock(struct inode *ip)
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
     ip->size = dip->size;
-    memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    memmove(ip->ext, dip->ext, sizeof(ip->ext));
+    ip->dindirect = dip->dindirect;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -311,6 +531,55 @@ ilock(struct inode *ip)
   }
 }
 
+// Lock the given inode shared with other readers, for readi,
+// stati and dirlookup.  Reads the inode from disk if necessary.
+void
+ilockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("ilockshared");
+
+  for(;;){
+    acquireshared(&ip->lock);
+    if(ip->valid)
+      return;
+    // Filling in the inode needs it exclusively.
+    releaseshared(&ip->lock);
+    ilock(ip);
+    iunlock(ip);
+  }
+}
+
+void
+iunlockshared(struct inode *ip)
+{
+  if(ip == 0 || ip->ref < 1)
+    panic("iunlockshared");
+
+  releaseshared(&ip->lock);
+}
+
+// Lock the given inode for readi: shared, unless it is a device,
+// whose read hook drops and retakes the lock exclusively.
+void
+ilockread(struct inode *ip)
+{
+  ilockshared(ip);
+  if(ip->type == T_DEV){
+    iunlockshared(ip);
+    ilock(ip);
+  }
+}
+
+void
+iunlockread(struct inode *ip)
+{
+  if(ip->type == T_DEV)
+    iunlock(ip);
+  else
+    iunlockshared(ip);
+}
+
 // Unlock the given inode.
 void
 iunlock(struct inode *ip)
@@ -342,12 +611,22 @@ iput(struct inode *ip)
       ip->type = 0;
       iupdate(ip);
       ip->valid = 0;
+      dcpurge(ip->dev, ip->inum);
+      acquire(&ifree.lock);
+      if(ip->inum/IPB < NINOBLK && ifree.nfree[ip->inum/IPB] >= 0)
+        ifree.nfree[ip->inum/IPB]++;
+      release(&ifree.lock);
     }
   }
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0){
+    ip->next = icache.head.next;
+    ip->prev = &icache.head;
+    icache.head.next->prev = ip;
+    icache.head.next = ip;
+  }
   release(&icache.lock);
 }
 
@@ -363,40 +642,98 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk.  ip->ext[] lists up to NEXTENT runs
+// of consecutive disk blocks, in file order.  Files only grow
+// at the end, so a new block that lands right after the last
+// run just makes it longer.  Once the runs are used up, the
+// remaining blocks are listed through the double-indirect
+// block ip->dindirect, counting from the end of the last run.
+
+// Allocate a block for ip, after the last one if possible.
+static uint
+inextblk(struct inode *ip, int data)
+{
+  uint b;
+
+  b = balloc(ip->dev, data, ip->nextblk);
+  ip->nextblk = b + 1;
+  return b;
+}
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
 static uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
+  uint addr, end, lo, hi, mid, *a;
+  struct extent *e;
   struct buf *bp;
 
-  if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
-    return addr;
+  // Binary search of the runs; unused ones sort last.
+  lo = 0;
+  hi = NEXTENT;
+  while(lo < hi){
+    mid = (lo + hi) / 2;
+    e = &ip->ext[mid];
+    if(e->len == 0 || bn < e->off)
+      hi = mid;
+    else if(bn >= e->off + e->len)
+      lo = mid + 1;
+    else
+      return e->start + bn - e->off;
   }
-  bn -= NDIRECT;
-
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  // bn lies past the lo runs in use.
+  e = lo > 0 ? &ip->ext[lo-1] : 0;
+  end = e ? e->off + e->len : 0;
+  bn -= end;
+
+  // Keep the file contiguous: ask for the block after the last
+  // one allocated, or after the last run.
+  if(ip->nextblk == 0 && e)
+    ip->nextblk = e->start + e->len;
+
+  addr = 0;
+  if(ip->dindirect == 0){
+    if(bn != 0)
+      panic("bmap: hole");
+    addr = inextblk(ip, ip->type == T_FILE);
+    if(end < MAXEXTBLK){
+      if(e && addr == e->start + e->len){
+        e->len++;
+        return addr;
+      }
+      if(lo < NEXTENT){
+        e = &ip->ext[lo];
+        e->start = addr;
+        e->off = end;
+        e->len = 1;
+        return addr;
+      }
     }
-    brelse(bp);
-    return addr;
   }
 
-  panic("bmap: out of range");
+  if(bn >= NDINDIRECT)
+    panic("bmap: out of range");
+  if(ip->dindirect == 0)
+    ip->dindirect = inextblk(ip, 0);
+  bp = bread(ip->dev, ip->dindirect);
+  a = (uint*)bp->data;
+  if((mid = a[bn / NINDIRECT]) == 0){
+    a[bn / NINDIRECT] = mid = inextblk(ip, 0);
+    log_write(bp);
+  }
+  brelse(bp);
+  bp = bread(ip->dev, mid);
+  a = (uint*)bp->data;
+  if(a[bn % NINDIRECT] == 0){
+    if(addr == 0)
+      addr = inextblk(ip, ip->type == T_FILE);
+    a[bn % NINDIRECT] = addr;
+    log_write(bp);
+  }
+  addr = a[bn % NINDIRECT];
+  brelse(bp);
+  return addr;
 }
 
 // Truncate inode (discard contents).
@@ -408,27 +745,35 @@ static void
 itrunc(struct inode *ip)
 {
   int i, j;
-  struct buf *bp;
-  uint *a;
+  struct buf *bp, *ibp;
+  uint *a, *b;
 
-  for(i = 0; i < NDIRECT; i++){
-    if(ip->addrs[i]){
-      bfree(ip->dev, ip->addrs[i]);
-      ip->addrs[i] = 0;
-    }
+  for(i = 0; i < NEXTENT; i++){
+    for(j = 0; j < ip->ext[i].len; j++)
+      bfree(ip->dev, ip->ext[i].start + j);
+    memset(&ip->ext[i], 0, sizeof(ip->ext[i]));
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
+  if(ip->dindirect){
+    bp = bread(ip->dev, ip->dindirect);
     a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+    for(i = 0; i < NINDIRECT; i++){
+      if(a[i] == 0)
+        continue;
+      ibp = bread(ip->dev, a[i]);
+      b = (uint*)ibp->data;
+      for(j = 0; j < NINDIRECT; j++){
+        if(b[j])
+          bfree(ip->dev, b[j]);
+      }
+      brelse(ibp);
+      bfree(ip->dev, a[i]);
     }
     brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
+    bfree(ip->dev, ip->dindirect);
+    ip->dindirect = 0;
   }
+  ip->nextblk = 0;
 
   ip->size = 0;
   iupdate(ip);
@@ -446,13 +791,59 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Map the n blocks of ip from bn on into addrs, and bring them
+// into the cache, one disk command per run of consecutive disk
+// blocks.
+static void
+prefetchi(struct inode *ip, uint bn, uint *addrs, int n)
+{
+  int i, start;
+
+  for(i = start = 0; i < n; i++){
+    addrs[i] = bmap(ip, bn + i);
+    if(i > start && addrs[i] != addrs[i-1] + 1){
+      if(i - start > 1)
+        bprefetch(ip->dev, addrs[start], i - start);
+      start = i;
+    }
+  }
+  if(n - start > 1)
+    bprefetch(ip->dev, addrs[start], n - start);
+}
+
+// Called after reading blocks first..last of ip.  If the read
+// continues where the last one stopped, start reading the next
+// NREADAHEAD blocks in the background.  Caller must hold ip->lock.
+static void
+readahead(struct inode *ip, uint first, uint last)
+{
+  uint bn, end, addrs[NREADAHEAD];
+  int n;
+
+  if(first != ip->ranext && first + 1 != ip->ranext){
+    ip->ranext = ip->raend = last + 1;
+    return;
+  }
+  ip->ranext = last + 1;
+  end = last + 1 + NREADAHEAD;
+  if(end > (ip->size + BSIZE - 1) / BSIZE)
+    end = (ip->size + BSIZE - 1) / BSIZE;
+  bn = ip->raend > last + 1 ? ip->raend : last + 1;
+  for(n = 0; bn < end; bn++)
+    addrs[n++] = bmap(ip, bn);
+  if(n > 0){
+    ip->raend = end;
+    breadahead(ip->dev, addrs, n);
+  }
+}
+
 //PAGEBREAK!
 // Read data from inode.
 // Caller must hold ip->lock.
 int
 readi(struct inode *ip, char *dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, bn, first, nb, addrs[BPREFETCH];
   struct buf *bp;
 
   if(ip->type == T_DEV){
@@ -466,12 +857,24 @@ readi(struct inode *ip, char *dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  first = nb = 0;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    bn = off/BSIZE;
+    if(bn >= first + nb){
+      // Map the next BPREFETCH blocks of the read, once.
+      first = bn;
+      nb = (off + n - tot - 1)/BSIZE + 1 - bn;
+      if(nb > BPREFETCH)
+        nb = BPREFETCH;
+      prefetchi(ip, first, addrs, nb);
+    }
+    bp = bread(ip->dev, addrs[bn - first]);
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(dst, bp->data + off%BSIZE, m);
     brelse(bp);
   }
+  if(n > 0)
+    readahead(ip, (off - n)/BSIZE, (off - 1)/BSIZE);
   return n;
 }
 
@@ -492,14 +895,18 @@ writei(struct inode *ip, char *src, uint off, uint n)
 
   if(off > ip->size || off + n < off)
     return -1;
-  if(off + n > MAXFILE*BSIZE)
+  // Compare in blocks: MAXFILE*BSIZE overflows with large blocks.
+  if(n > 0 && (off + n - 1)/BSIZE >= MAXFILE)
     return -1;
 
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
     bp = bread(ip->dev, bmap(ip, off/BSIZE));
     m = min(n - tot, BSIZE - off%BSIZE);
     memmove(bp->data + off%BSIZE, src, m);
-    log_write(bp);
+    if(ip->type == T_FILE)
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -519,18 +926,128 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+static uint dirhash(char*);
+
+static struct dcentry*
+dcset(uint dev, uint dir, char *name)
+{
+  return dcache.e[(dirhash(name) + dir*31 + dev) % NDCSET];
+}
+
+// Look up name in directory dp in the name cache.  On a hit,
+// set *ipp to the inode, or 0 if name is known to be absent,
+// and return 1.  Return 0 if name is not cached.
+static int
+dclookup(struct inode *dp, char *name, struct inode **ipp)
+{
+  struct dcentry *e;
+  int i;
+
+  acquire(&dcache.lock);
+  e = dcset(dp->dev, dp->inum, name);
+  for(i = 0; i < DCWAYS; i++, e++){
+    if(e->dir == dp->inum && e->dev == dp->dev &&
+       namecmp(e->name, name) == 0){
+      e->used = ++dcache.clock;
+      // Take the reference before an unlink can change the entry.
+      *ipp = e->inum ? iget(e->dev, e->inum) : 0;
+      release(&dcache.lock);
+      return 1;
+    }
+  }
+  release(&dcache.lock);
+  return 0;
+}
+
+// Record that name in directory dp is inum (0: absent).
+// Caller must hold dp->lock, shared if only looking up.
+void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dcentry *e, *victim;
+  int i;
+
+  acquire(&dcache.lock);
+  e = dcset(dp->dev, dp->inum, name);
+  victim = e;
+  for(i = 0; i < DCWAYS; i++, e++){
+    if(e->dir == dp->inum && e->dev == dp->dev &&
+       namecmp(e->name, name) == 0){
+      victim = e;
+      break;
+    }
+    if(e->used < victim->used)
+      victim = e;
+  }
+  victim->dev = dp->dev;
+  victim->dir = dp->inum;
+  victim->inum = inum;
+  victim->used = ++dcache.clock;
+  strncpy(victim->name, name, DIRSIZ);
+  release(&dcache.lock);
+}
+
+// Forget every entry in or for inode inum, which is being freed.
+static void
+dcpurge(uint dev, uint inum)
+{
+  struct dcentry *e;
+
+  acquire(&dcache.lock);
+  for(e = &dcache.e[0][0]; e < &dcache.e[0][0] + NDCSET*DCWAYS; e++)
+    if(e->dev == dev && (e->dir == inum || e->inum == inum)){
+      e->dir = 0;
+      e->used = 0;  // reuse first
+    }
+  release(&dcache.lock);
+}
+
+// FNV-1a hash of a directory entry name.
+static uint
+dirhash(char *name)
+{
+  uint h;
+  int i;
+
+  h = 2166136261;
+  for(i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Word i of a hashed directory's index block.
+static ushort*
+idxword(struct buf *bp, int i)
+{
+  return (ushort*)bp->data + i + i/7 + 1;
+}
+
+// Directory block of the bucket for hash h.
+static uint
+dirbucket(struct buf *ibp, uint h)
+{
+  return *idxword(ibp, 1 + (h & ((1 << *idxword(ibp, 0)) - 1)));
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
-  struct dirent de;
+  uint off, inum, b;
+  int i;
+  struct dirent de, *dep;
+  struct buf *bp;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
+  if(poff == 0 && dclookup(dp, name, &ip))
+    return ip;
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  for(off = 0; off < dp->size && off < DIRLINEAR*BSIZE; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
@@ -540,13 +1057,124 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcenter(dp, name, inum);
       return iget(dp->dev, inum);
     }
   }
+  if(dp->size <= DIRLINEAR*BSIZE){
+    dcenter(dp, name, 0);
+    return 0;
+  }
 
+  // Hashed: one index block and one bucket.
+  bp = bread(dp->dev, bmap(dp, DIRLINEAR));
+  b = dirbucket(bp, dirhash(name));
+  brelse(bp);
+  bp = bread(dp->dev, bmap(dp, b));
+  dep = (struct dirent*)bp->data;
+  for(i = 0; i < BSIZE/sizeof(de); i++){
+    if(dep[i].inum != 0 && namecmp(name, dep[i].name) == 0){
+      if(poff)
+        *poff = b*BSIZE + i*sizeof(de);
+      inum = dep[i].inum;
+      brelse(bp);
+      dcenter(dp, name, inum);
+      return iget(dp->dev, inum);
+    }
+  }
+  brelse(bp);
+  dcenter(dp, name, 0);
   return 0;
 }
 
+// Append a zeroed block to directory dp; return its number.
+static uint
+dirgrow(struct inode *dp)
+{
+  uint b;
+
+  b = dp->size / BSIZE;
+  bmap(dp, b);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return b;
+}
+
+// Add (name, inum) to the hashed part of dp, which is made
+// hashed if it is not yet.  A full bucket is split, and split
+// again while the entry's half stays full; returns -1 only if
+// the index is at its maximum depth.
+static int
+dirhashlink(struct inode *dp, char *name, uint inum)
+{
+  int i, j, n, g, l;
+  uint h, b, nb;
+  struct buf *ibp, *bp, *nbp;
+  struct dirent *de, *nde;
+
+  if(dp->size == DIRLINEAR*BSIZE){
+    dirgrow(dp);  // index, depth 0
+    ibp = bread(dp->dev, bmap(dp, DIRLINEAR));
+    *idxword(ibp, 1) = dirgrow(dp);
+    log_write(ibp);
+  } else
+    ibp = bread(dp->dev, bmap(dp, DIRLINEAR));
+
+  h = dirhash(name);
+  for(;;){
+    b = dirbucket(ibp, h);
+    bp = bread(dp->dev, bmap(dp, b));
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < BSIZE/sizeof(*de); i++){
+      if(de[i].inum == 0){
+        strncpy(de[i].name, name, DIRSIZ);
+        de[i].inum = inum;
+        log_write(bp);
+        brelse(bp);
+        brelse(ibp);
+        return 0;
+      }
+    }
+
+    // Split bucket b.  Its 2^(g-l) index entries agree in the
+    // low l bits; those with bit l set move to a new bucket.
+    g = *idxword(ibp, 0);
+    n = 0;
+    for(j = 0; j < (1 << g); j++)
+      if(*idxword(ibp, 1 + j) == b)
+        n++;
+    for(l = g; n > 1; n >>= 1)
+      l--;
+    if(l == g){
+      if((2 << g) >= DIRIDXWORDS)
+        break;  // index is full
+      for(j = 0; j < (1 << g); j++)
+        *idxword(ibp, 1 + (1 << g) + j) = *idxword(ibp, 1 + j);
+      *idxword(ibp, 0) = ++g;
+    }
+    nb = dirgrow(dp);
+    for(j = 0; j < (1 << g); j++)
+      if(*idxword(ibp, 1 + j) == b && (j >> l) & 1)
+        *idxword(ibp, 1 + j) = nb;
+    nbp = bread(dp->dev, bmap(dp, nb));
+    nde = (struct dirent*)nbp->data;
+    for(i = 0; i < BSIZE/sizeof(*de); i++){
+      if((dirhash(de[i].name) >> l) & 1){
+        *nde++ = de[i];
+        memset(&de[i], 0, sizeof(*de));
+      }
+    }
+    log_write(ibp);
+    log_write(bp);
+    log_write(nbp);
+    brelse(nbp);
+    brelse(bp);
+  }
+  brelse(bp);
+  brelse(ibp);
+  return -1;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
@@ -561,18 +1189,25 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  // Look for an empty dirent in the unhashed blocks.
+  for(off = 0; off < dp->size && off < DIRLINEAR*BSIZE; off += sizeof(de)){
     if(readi(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlink read");
     if(de.inum == 0)
       break;
   }
+  if(off == DIRLINEAR*BSIZE){
+    if(dirhashlink(dp, name, inum) < 0)
+      return -1;
+    dcenter(dp, name, inum);
+    return 0;
+  }
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp, name, inum);
 
   return 0;
 }
@@ -632,21 +1267,31 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
-    ilock(ip);
+    // Only directories have cached names, so a hit needs
+    // neither the lock nor the type check.
+    if(!(nameiparent && *path == '\0') && dclookup(ip, name, &next)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
+    ilockshared(ip);
     if(ip->type != T_DIR){
-      iunlockput(ip);
+      iunlockshared(ip);
+      iput(ip);
       return 0;
     }
     if(nameiparent && *path == '\0'){
       // Stop one level early.
-      iunlock(ip);
+      iunlockshared(ip);
       return ip;
     }
-    if((next = dirlookup(ip, name, 0)) == 0){
-      iunlockput(ip);
+    next = dirlookup(ip, name, 0);
+    iunlockshared(ip);
+    iput(ip);
+    if(next == 0)
       return 0;
-    }
-    iunlockput(ip);
     ip = next;
   }
   if(nameiparent){
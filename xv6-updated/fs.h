@@ -3,7 +3,9 @@
 
 
 #define ROOTINO 1  // root i-number
-#define BSIZE 512  // block size
+#ifndef BSIZE
+#define BSIZE 512  // block size; a multiple of 512 dividing PGSIZE
+#endif
 
 // Disk layout:
 // [ boot block | super block | log | inode blocks |
@@ -19,11 +21,24 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_* mount options
 };
 
-#define NDIRECT 12
+#define FS_ORDERED 0x1  // journal metadata only; write file data in place
+
+#define NEXTENT 6
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define MAXEXTBLK 0xffff  // extents cover file blocks below this
+// Worst case, when no two blocks of the file are adjacent.
+#define MAXFILE (NEXTENT + NDINDIRECT)
+
+// Disk blocks start..start+len-1 hold file blocks off..off+len-1.
+struct extent {
+  uint start;
+  ushort off;
+  ushort len;
+};
 
 // On-disk inode structure
 struct dinode {
@@ -32,7 +47,8 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  struct extent ext[NEXTENT];  // Data block runs, in file order
+  uint dindirect;       // Double-indirect block for the rest
 };
 
 // Inodes per block.
@@ -55,3 +71,14 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory's first DIRLINEAR blocks hold entries in no
+// particular order.  A directory that outgrows them is hashed:
+// block DIRLINEAR is an index and each later block is a bucket
+// of entries, as in extendible hashing.  Index word 0 is the
+// depth d, and words 1..2^d point to the bucket (directory block
+// number) for each value of the low d bits of the name's hash.
+// The index skips every eighth ushort of its block, so that read
+// as dirents it has only free slots (inum 0).
+#define DIRLINEAR 2
+#define DIRIDXWORDS (BSIZE/sizeof(struct dirent)*7)
+
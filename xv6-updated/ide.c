@@ -1,4 +1,5 @@
-// Simple PIO-based (non-DMA) IDE driver code.
+// Simple IDE driver code.  Transfers use PCI bus-master DMA when
+// the controller supports it and PIO otherwise.
 
 #include "types.h"
 #include "defs.h"
@@ -12,6 +13,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "buf.h"
+#include "pci.h"
 
 #define SECTOR_SIZE   512
 #define IDE_BSY       0x80
@@ -23,16 +25,55 @@
 #define IDE_CMD_WRITE 0x30
 #define IDE_CMD_RDMUL 0xc4
 #define IDE_CMD_WRMUL 0xc5
+#define IDE_CMD_SETMUL 0xc6
+#define IDE_CMD_RDDMA 0xc8
+#define IDE_CMD_WRDMA 0xca
+
+// Bus-master registers of the primary channel, offsets from BAR4.
+#define BM_CMD        0
+#define BM_STATUS     2
+#define BM_PRDT       4
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08  // controller writes to memory
+#define BM_ST_ERR     0x02
+#define BM_ST_INTR    0x04
+
+// Physical region descriptor: one memory range of a DMA transfer.
+struct prd {
+  uint addr;
+  ushort len;
+  ushort flags;
+};
+#define PRD_EOT       0x8000  // last entry in the table
+
+#define IDEDEADLINE   50  // ticks a request may wait before it jumps the sweep
+#define IDEMULT       16  // sectors per interrupt in READ/WRITE MULTIPLE
+#define IDEMAXRUN     (IDEMULT/(BSIZE/SECTOR_SIZE))  // max buffers per command
+
+#if BSIZE % SECTOR_SIZE != 0 || BSIZE/SECTOR_SIZE > IDEMULT
+#error "BSIZE must be 1 to IDEMULT sectors"
+#endif
 
 // idequeue points to the buf now being read/written to the disk.
 // idequeue->qnext points to the next buf to be processed.
+// The first idenrun bufs belong to the command in progress; the
+// rest are kept in C-LOOK order: ascending block numbers from
+// where the disk head is, then wrapping around to the lowest.
 // You must hold idelock while manipulating queue.
 
 static struct spinlock idelock;
 static struct buf *idequeue;
+static int idenrun;
+static int idesect;    // sector of idequeue's block in transfer, without multiple mode
 
 static int havedisk1;
-static void idestart(struct buf*);
+static int virtiodisk1;  // disk 1 is a virtio-blk device instead
+static int idemult;    // drives accepted READ/WRITE MULTIPLE
+static uint idebm;     // bus-master I/O base, 0 if using PIO
+
+// The PRD table may not cross a 64 KB boundary.
+static struct prd prdt[IDEMAXRUN] __attribute__((aligned(256)));
+static void idestart(void);
 
 // Wait for IDE disk to become ready.
 static int
@@ -50,6 +91,7 @@ idewait(int checkerr)
 void
 ideinit(void)
 {
+  struct pcidev pci;
   int i;
 
   initlock(&idelock, "ide");
@@ -64,46 +106,160 @@ ideinit(void)
       break;
     }
   }
+  if(!havedisk1 && virtioinit() == 0)
+    virtiodisk1 = 1;
+
+  // Have each drive transfer up to IDEMULT sectors per
+  // interrupt, so a merged command completes in one interrupt.
+  // Without that, fall back to an interrupt per sector.
+  idemult = 1;
+  for(i = havedisk1; i >= 0; i--){
+    outb(0x1f2, IDEMULT);
+    outb(0x1f6, 0xe0 | (i<<4));
+    outb(0x1f7, IDE_CMD_SETMUL);
+    if(idewait(1) < 0)
+      idemult = 0;
+  }
 
   // Switch back to disk 0.
   outb(0x1f6, 0xe0 | (0<<4));
+
+  // Use bus-master DMA if a PCI IDE controller has its
+  // bus-master registers in I/O space.
+  if(pcifind(&pci, PCI_ANY, PCI_ANY, 0x01, 0x01) == 0 &&
+     (pci.bar[4] & PCI_BAR_IO)){
+    idebm = pci.bar[4] & ~3;
+    pcienable(&pci, PCI_CMD_IO | PCI_CMD_MASTER);
+  }
 }
 
-// Start the request for b.  Caller must hold idelock.
+// Point the bus-master engine at the data of the n bufs from b on.
 static void
-idestart(struct buf *b)
+dmasetup(struct buf *b, int n)
 {
+  int i;
+
+  for(i = 0; i < n; i++, b = b->qnext){
+    prdt[i].addr = V2P(b->data);
+    prdt[i].len = BSIZE;
+    prdt[i].flags = 0;
+  }
+  prdt[n-1].flags = PRD_EOT;
+  outl(idebm + BM_PRDT, V2P(prdt));
+  outb(idebm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);  // clear
+}
+
+// Start a disk command for the buf at the head of idequeue,
+// merged with the bufs after it that continue on consecutive
+// blocks in the same direction.  Caller must hold idelock.
+static void
+idestart(void)
+{
+  struct buf *b, *last;
+  int n, bmcmd;
+
+  b = idequeue;
   if(b == 0)
     panic("idestart");
-  if(b->blockno >= FSSIZE)
+  for(last = b, n = 1; n < IDEMAXRUN && last->qnext; last = last->qnext, n++){
+    if(last->qnext->dev != b->dev ||
+       last->qnext->blockno != last->blockno + 1 ||
+       (last->qnext->flags & B_DIRTY) != (b->flags & B_DIRTY))
+      break;
+  }
+  if(last->blockno >= FSSIZE)
     panic("incorrect blockno");
+  idenrun = n;
+  idesect = 0;
   int sector_per_block =  BSIZE/SECTOR_SIZE;
   int sector = b->blockno * sector_per_block;
-  int read_cmd = (sector_per_block == 1) ? IDE_CMD_READ :  IDE_CMD_RDMUL;
-  int write_cmd = (sector_per_block == 1) ? IDE_CMD_WRITE : IDE_CMD_WRMUL;
+  int read_cmd = idemult ? IDE_CMD_RDMUL : IDE_CMD_READ;
+  int write_cmd = idemult ? IDE_CMD_WRMUL : IDE_CMD_WRITE;
 
-  if (sector_per_block > 7) panic("idestart");
+  if (n * sector_per_block > 255) panic("idestart");
 
   idewait(0);
   outb(0x3f6, 0);  // generate interrupt
-  outb(0x1f2, sector_per_block);  // number of sectors
+  outb(0x1f2, n * sector_per_block);  // number of sectors
   outb(0x1f3, sector & 0xff);
   outb(0x1f4, (sector >> 8) & 0xff);
   outb(0x1f5, (sector >> 16) & 0xff);
   outb(0x1f6, 0xe0 | ((b->dev&1)<<4) | ((sector>>24)&0x0f));
-  if(b->flags & B_DIRTY){
+  if(idebm){
+    dmasetup(b, n);
+    bmcmd = (b->flags & B_DIRTY) ? 0 : BM_CMD_READ;
+    outb(idebm + BM_CMD, bmcmd);
+    outb(0x1f7, (b->flags & B_DIRTY) ? IDE_CMD_WRDMA : IDE_CMD_RDDMA);
+    outb(idebm + BM_CMD, bmcmd | BM_CMD_START);
+  } else if(b->flags & B_DIRTY){
     outb(0x1f7, write_cmd);
-    outsl(0x1f0, b->data, BSIZE/4);
+    // In multiple mode the drive takes the whole command's data
+    // up front; otherwise one sector now, the rest in ideintr.
+    if(!idemult)
+      outsl(0x1f0, b->data, SECTOR_SIZE/4);
+    else
+      for(; n > 0; n--, b = b->qnext)
+        outsl(0x1f0, b->data, BSIZE/4);
   } else {
     outb(0x1f7, read_cmd);
   }
 }
 
+// Does a come before b in a sweep that is now at block pos?
+static int
+sweepbefore(struct buf *a, struct buf *b, uint pos)
+{
+  int wrapa, wrapb;
+
+  wrapa = a->blockno < pos;
+  wrapb = b->blockno < pos;
+  if(wrapa != wrapb)
+    return wrapb;
+  return a->blockno < b->blockno;
+}
+
+// Insert b into the sorted list at *pp for a sweep at block pos.
+static void
+qinsert(struct buf **pp, struct buf *b, uint pos)
+{
+  for(; *pp && !sweepbefore(b, *pp, pos); pp = &(*pp)->qnext)
+    ;
+  b->qnext = *pp;
+  *pp = b;
+}
+
+// Before starting the next command, let the request that has
+// waited longest jump the sweep if it is past its deadline, and
+// re-sort the rest of the queue around its block.
+static void
+idedeadline(void)
+{
+  struct buf **pp, **oldest, *b, *rest, *next;
+
+  oldest = 0;
+  for(pp = &idequeue; *pp; pp = &(*pp)->qnext)
+    if(ticks - (*pp)->qtime >= IDEDEADLINE &&
+       (oldest == 0 || (*pp)->qtime < (*oldest)->qtime))
+      oldest = pp;
+  if(oldest == 0 || oldest == &idequeue)
+    return;
+  b = *oldest;
+  *oldest = b->qnext;
+  rest = idequeue;
+  idequeue = b;
+  b->qnext = 0;
+  for(; rest; rest = next){
+    next = rest->qnext;
+    qinsert(&b->qnext, rest, b->blockno);
+  }
+}
+
 // Interrupt handler.
 void
 ideintr(void)
 {
   struct buf *b;
+  int n, ok, st;
 
   // First queued buffer is the active request.
   acquire(&idelock);
@@ -112,57 +268,146 @@ ideintr(void)
     release(&idelock);
     return;
   }
-  idequeue = b->qnext;
 
-  // Read data if needed.
-  if(!(b->flags & B_DIRTY) && idewait(1) >= 0)
-    insl(0x1f0, b->data, BSIZE/4);
+  if(idebm){
+    st = inb(idebm + BM_STATUS);
+    if((st & BM_ST_INTR) == 0){
+      // Not ours: the transfer is still running.
+      release(&idelock);
+      return;
+    }
+    outb(idebm + BM_CMD, 0);
+    outb(idebm + BM_STATUS, BM_ST_ERR | BM_ST_INTR);
+    if(idewait(1) < 0 || (st & BM_ST_ERR)){
+      // Redo the command with PIO from now on.
+      cprintf("ide: dma failed, using pio\n");
+      idebm = 0;
+      idestart();
+      release(&idelock);
+      return;
+    }
+    ok = 1;
+  } else
+    ok = idewait(1) >= 0;
+
+  if(!idebm && !idemult){
+    // One interrupt per sector: move it, and finish the block
+    // only after its last sector.
+    if(!(b->flags & B_DIRTY) && ok)
+      insl(0x1f0, b->data + idesect*SECTOR_SIZE, SECTOR_SIZE/4);
+    if(++idesect < BSIZE/SECTOR_SIZE){
+      if(b->flags & B_DIRTY){
+        idewait(0);
+        outsl(0x1f0, b->data + idesect*SECTOR_SIZE, SECTOR_SIZE/4);
+      }
+      release(&idelock);
+      return;
+    }
+    idesect = 0;
+  }
+
+  // With DMA or in multiple mode one interrupt finishes the
+  // whole command.
+  for(n = (idebm || idemult) ? idenrun : 1; n > 0; n--){
+    b = idequeue;
+    idequeue = b->qnext;
+    idenrun--;
 
-  // Wake process waiting for this buf.
-  b->flags |= B_VALID;
-  b->flags &= ~B_DIRTY;
-  wakeup(b);
+    // Read data if needed.
+    if(!(b->flags & B_DIRTY) && ok && !idebm && idemult)
+      insl(0x1f0, b->data, BSIZE/4);
 
-  // Start disk on next buf in queue.
-  if(idequeue != 0)
-    idestart(idequeue);
+    // Wake process waiting for this buf.
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC)
+      bdone(b);
+    else
+      wakeup(b);
+  }
+
+  if(idenrun > 0){
+    // The same command goes on with the next block; a write
+    // needs its first sector.
+    if(idequeue->flags & B_DIRTY){
+      idewait(0);
+      outsl(0x1f0, idequeue->data, SECTOR_SIZE/4);
+    }
+  } else if(idequeue != 0){
+    // Start disk on next buf in queue.
+    idedeadline();
+    idestart();
+  }
 
   release(&idelock);
 }
 
 //PAGEBREAK!
-// Sync buf with disk.
-// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
-// Else if B_VALID is not set, read buf from disk, set B_VALID.
+// Sync n bufs with disk as one batch, so that runs of
+// consecutive blocks go out as single multi-block commands.
+// For each buf: if B_DIRTY is set, write it to disk, clear
+// B_DIRTY, set B_VALID; else read it from disk, set B_VALID.
+// If the bufs have B_ASYNC set, return without waiting; each
+// is handed to bdone when its transfer finishes.
 void
-iderw(struct buf *b)
+iderwv(struct buf **bv, int n)
 {
-  struct buf **pp;
+  struct buf *b, **pp;
+  uint pos;
+  int i, j, async;
 
-  if(!holdingsleep(&b->lock))
-    panic("iderw: buf not locked");
-  if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
-    panic("iderw: nothing to do");
-  if(b->dev != 0 && !havedisk1)
-    panic("iderw: ide disk 1 not present");
+  async = bv[0]->flags & B_ASYNC;
+  for(j = 0; j < n; j++){
+    b = bv[j];
+    if(!holdingsleep(&b->lock))
+      panic("iderw: buf not locked");
+    if((b->flags & (B_VALID|B_DIRTY)) == B_VALID)
+      panic("iderw: nothing to do");
+    if(b->dev != bv[0]->dev || (b->flags & B_ASYNC) != (bv[0]->flags & B_ASYNC))
+      panic("iderw: mixed batch");
+    if(b->dev != 0 && !havedisk1 && !virtiodisk1)
+      panic("iderw: ide disk 1 not present");
+  }
+  if(bv[0]->dev != 0 && virtiodisk1){
+    virtiorw(bv, n);
+    return;
+  }
 
   acquire(&idelock);  //DOC:acquire-lock
 
-  // Append b to idequeue.
-  b->qnext = 0;
-  for(pp=&idequeue; *pp; pp=&(*pp)->qnext)  //DOC:insert-queue
-    ;
-  *pp = b;
+  // Insert the bufs into idequeue after the command in progress,
+  // in sweep order from the last block that command touches.
+  pos = bv[0]->blockno;
+  pp = &idequeue;
+  for(i = 0; i < idenrun; i++){
+    pos = (*pp)->blockno;
+    pp = &(*pp)->qnext;
+  }
+  for(j = 0; j < n; j++){
+    bv[j]->qtime = ticks;
+    qinsert(pp, bv[j], pos);  //DOC:insert-queue
+  }
 
   // Start disk if necessary.
-  if(idequeue == b)
-    idestart(b);
+  if(idenrun == 0 && idequeue != 0)
+    idestart();
 
-  // Wait for request to finish.
-  while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
-    sleep(b, &idelock);
+  // Wait for requests to finish.
+  for(j = 0; j < n && !async; j++){
+    b = bv[j];
+    while((b->flags & (B_VALID|B_DIRTY)) != B_VALID){
+      sleep(b, &idelock);
+    }
   }
 
-
   release(&idelock);
 }
+
+// Sync buf with disk.
+// If B_DIRTY is set, write buf to disk, clear B_DIRTY, set B_VALID.
+// Else if B_VALID is not set, read buf from disk, set B_VALID.
+void
+iderw(struct buf *b)
+{
+  iderwv(&b, 1);
+}
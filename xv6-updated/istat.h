@@ -0,0 +1,8 @@
+// Inode cache counters, returned by istat().
+struct istat {
+  uint ninode;     // inodes currently in the cache
+  uint hits;
+  uint misses;
+  uint reclaims;   // unreferenced inodes recycled to hold another
+  uint grows;      // pages added to the cache
+};
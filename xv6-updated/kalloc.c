@@ -21,6 +21,8 @@ struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  int nfree;
+  uchar ref[PHYSTOP / PGSIZE];  // mappings of each physical page
 } kmem;
 
 // Initialization happens in two phases.
@@ -56,6 +58,8 @@ freerange(void *vstart, void *vend)
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// A page shared copy-on-write is only freed once
+// its last reference is dropped.
 void
 kfree(char *v)
 {
@@ -64,6 +68,18 @@ kfree(char *v)
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  if(kmem.ref[V2P(v) / PGSIZE] > 1){
+    kmem.ref[V2P(v) / PGSIZE]--;
+    if(kmem.use_lock)
+      release(&kmem.lock);
+    return;
+  }
+  kmem.ref[V2P(v) / PGSIZE] = 0;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
 
@@ -72,25 +88,64 @@ kfree(char *v)
   r = (struct run*)v;
   r->next = kmem.freelist;
   kmem.freelist = r;
+  kmem.nfree++;
   if(kmem.use_lock)
     release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
+// Returns 0 if the memory cannot be allocated,
+// even after shrinking the buffer cache.
 char*
 kalloc(void)
 {
   struct run *r;
 
+again:
   if(kmem.use_lock)
     acquire(&kmem.lock);
   r = kmem.freelist;
-  if(r)
+  if(r){
     kmem.freelist = r->next;
+    kmem.nfree--;
+    kmem.ref[V2P(r) / PGSIZE] = 1;
+  }
   if(kmem.use_lock)
     release(&kmem.lock);
-
+  if(r == 0 && kmem.use_lock && bshrink() > 0)
+    goto again;
   return (char*)r;
-}
\ No newline at end of file
+}
+
+// Number of free pages.
+int
+kfreepages(void)
+{
+  return kmem.nfree;
+}
+
+// Record one more mapping of the page at v.
+void
+krefpage(void *v)
+{
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  kmem.ref[V2P(v) / PGSIZE]++;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Number of mappings of the page at v.
+int
+kgetrefcount(void *v)
+{
+  int n;
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  n = kmem.ref[V2P(v) / PGSIZE];
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return n;
+}
@@ -13,12 +13,17 @@
 // no FS system calls active. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
+// Once the committed blocks are copied, new system calls start
+// the next transaction while the copies are written out.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
+// A system call that writes regular file data uses
+// begin_dataop()/end_dataop() instead, which reserve room for
+// the data as well.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
@@ -28,6 +33,27 @@
 //   block C
 //   ...
 // Log appends are synchronous.
+//
+// A file system made with mkfs -o is mounted in ordered mode:
+// regular file data does not go through the log.  log_data()
+// pins such blocks in the cache and commit() writes them to
+// their home locations before it writes the log, so metadata
+// never points at data that is not on disk.  Blocks freed or
+// logged since the last checkpoint are "busy": balloc passes
+// them over, and file data written to one is logged after all,
+// because a crash could otherwise replay stale log contents
+// over it or undo the free.
+//
+// Installing committed blocks to their home locations is left to
+// the flusher thread, so a commit costs only the log writes.
+// Committed transactions pile up in the log behind each other;
+// a block changed again after it was committed gets a new log
+// slot rather than overwriting the committed one.  The flusher
+// checkpoints (installs everything and empties the log) once the
+// oldest commit is LOGFLUSH ticks old, when begin_op finds the
+// log full, or on sync()/fsync().  Checkpoints run only while no
+// FS system call is active, so the cached copies of the logged
+// blocks hold committed data.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -41,14 +67,36 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // copying a commit or in checkpoint(), please wait.
+  int writing;     // a commit is writing the log
   int dev;
+  int committed;   // lh.block[0..committed) are committed
+  int cend;        // lh.block[committed..cend) are being committed
+  uint txn;        // the open transaction
+  uint donetxn;    // last committed transaction
+  int ended;       // operations of the open transaction that ended
+  uint since;      // ticks at the oldest uninstalled commit
+  int pressure;    // a checkpoint is wanted; hold off begin_op
   struct logheader lh;
+  struct buf *buf[LOGSIZE];  // held by commit, checkpoint or recovery
+
+  int ordered;     // FS_ORDERED: file data is not logged
+  int dataops;     // outstanding ops that may write file data
+  int ndata;       // file data blocks of the open transaction
+  int data[LOGDATA];
+  int ncdata;      // file data blocks being committed
+  int cdata[LOGDATA];
+  struct buf *dbuf[LOGDATA];
+  uchar busy[(FSSIZE+7)/8];  // freed or logged since checkpoint
 };
 struct log log;
 
 static void recover_from_log(void);
 static void commit();
+static void checkpoint(void);
+static int isbusy(uint);
+static void markbusy(uint);
+static void kickflusher(void);
 
 void
 initlog(int dev)
@@ -62,23 +110,34 @@ initlog(int dev)
   log.start = sb.logstart;
   log.size = sb.nlog;
   log.dev = dev;
+  log.ordered = (sb.flags & FS_ORDERED) != 0;
+  log.txn = 1;
   recover_from_log();
+  kthread("flusher", logflusher);
 }
 
-// Copy committed blocks from log to their home location
+// Copy committed blocks from log to their cached home blocks
+// and pin them there; checkpoint() then writes them out.  The
+// reads of all the log blocks are started at once, so the disk
+// can stream the whole log.  A block logged more than once ends
+// up with the later copy.
 static void
 install_trans(void)
 {
-  int tail;
+  struct buf *dbuf;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    brelse(lbuf);
+  for (i = 0; i < log.lh.n; i++)
+    log.buf[i] = bread_async(log.dev, log.start+i+1); // read log block
+  for (i = 0; i < log.lh.n; i++) {
+    bwait(log.buf[i]);
+    dbuf = bclaim(log.dev, log.lh.block[i]); // dst, fully overwritten
+    memmove(dbuf->data, log.buf[i]->data, BSIZE);  // copy block to dst
+    dbuf->flags |= B_DIRTY;
     brelse(dbuf);
+    brelse(log.buf[i]);
   }
+  log.committed = log.cend = log.lh.n;
 }
 
 // Read the log header from disk into the in-memory log header
@@ -95,17 +154,18 @@ read_head(void)
   brelse(buf);
 }
 
-// Write in-memory log header to disk.
+// Write the first n entries of the in-memory log header to disk.
 // This is the true point at which the
 // current transaction commits.
 static void
-write_head(void)
+write_head(int n)
 {
-  struct buf *buf = bread(log.dev, log.start);
+  struct buf *buf = bclaim(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
+  memset(buf->data, 0, BSIZE);  // claimed, not read: clear stale bytes
+  hb->n = n;
+  for (i = 0; i < n; i++) {
     hb->block[i] = log.lh.block[i];
   }
   bwrite(buf);
@@ -116,88 +176,308 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  install_trans(); // if committed, copy from log to cache
+  checkpoint();    // write to disk and clear the log
 }
 
 // called at the start of each FS system call.
-void
-begin_op(void)
+// data says the op may write up to MAXOPDATA blocks of file data.
+// In ordered mode those blocks are still logged if they are busy,
+// so a data op reserves log space for them too.
+static void
+beginop(int data)
 {
+  int extra = log.ordered ? MAXOPDATA : 0;
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.committing || log.pressure){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS +
+              (log.dataops+data)*extra > LOGSIZE){
+      // this op might exhaust log space; wait for commit
+      // and have the flusher checkpoint.
+      log.pressure = 1;
+      kickflusher();
+      sleep(&log, &log.lock);
+    } else if(data && log.ndata + (log.dataops+1)*extra > LOGDATA){
+      // this op might overflow the data list; wait for commit.
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
+      log.dataops += data;
       release(&log.lock);
       break;
     }
   }
 }
 
+void
+begin_op(void)
+{
+  beginop(0);
+}
+
+void
+begin_dataop(void)
+{
+  beginop(1);
+}
+
+// called at the end of an FS system call that began with
+// begin_dataop().
+void
+end_dataop(void)
+{
+  acquire(&log.lock);
+  log.dataops -= 1;
+  release(&log.lock);
+  end_op();
+}
+
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// The last outstanding operation commits the transaction, or
+// leaves it to the commit that is already writing, which takes
+// it next.  Either way, return once it is committed.
 void
 end_op(void)
 {
   int do_commit = 0;
+  uint txn;
 
   acquire(&log.lock);
   log.outstanding -= 1;
   if(log.committing)
     panic("log.committing");
-  if(log.outstanding == 0){
+  txn = log.txn;
+  if(log.outstanding == 0 && !log.writing){
+    // Hold off begin_op until commit() has snapshotted the
+    // transaction; it must not gain operations in between.
     do_commit = 1;
+    log.writing = 1;
     log.committing = 1;
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
     // the amount of reserved space.
+    log.ended++;
     wakeup(&log);
   }
-  release(&log.lock);
 
   if(do_commit){
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
+    release(&log.lock);
     commit();
+    if(log.pressure)
+      kickflusher();
+    return;
+  }
+  while(log.donetxn < txn)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
+
+// Sort the n block numbers in b and drop repeats.
+// Returns how many are left.
+static int
+sortblocks(int *b, int n)
+{
+  int i, j, k, m, x;
+
+  m = 0;
+  for (i = 0; i < n; i++) {
+    x = b[i];
+    for (j = 0; j < m && b[j] < x; j++)
+      ;
+    if (j < m && b[j] == x)   // repeat
+      continue;
+    for (k = m; k > j; k--)
+      b[k] = b[k-1];
+    b[j] = x;
+    m++;
+  }
+  return m;
+}
+
+// Copy blocks lh.block[from..to) from cache into log buffers.
+// Runs while begin_op is held off, so the copies are exactly
+// what the transaction wrote.  The log blocks are about to be
+// overwritten, so they are not read first.
+static void
+snapshot_log(struct buf **to, int from, int end)
+{
+  struct buf *b;
+  int i;
+
+  for (i = from; i < end; i++) {
+    to[i-from] = bclaim(log.dev, log.start+i+1); // log block
+    b = bread(log.dev, log.lh.block[i]); // cache block
+    memmove(to[i-from]->data, b->data, BSIZE);
+    brelse(b);
+  }
+}
+
+// Write the n snapshot buffers to the log and release them.
+// They are consecutive on disk, so they go down as one batch
+// that the disk driver turns into a few multi-block commands.
+static void
+write_log(struct buf **to, int n)
+{
+  int i;
+
+  bwritev(to, n);
+  for (i = 0; i < n; i++)
+    brelse(to[i]);
+}
+
+// Write the file data blocks of the transaction being committed
+// to their home locations, in block order.
+static void
+write_data(void)
+{
+  int i, n;
+
+  n = sortblocks(log.cdata, log.ncdata);
+  for (i = 0; i < n; i++)
+    log.dbuf[i] = bread(log.dev, log.cdata[i]);
+  bwritev(log.dbuf, n);  // clears B_DIRTY
+  for (i = 0; i < n; i++)
+    brelse(log.dbuf[i]);
+}
+
+// Group commit.  Called with log.writing and log.committing set
+// by the end_op that finished the open transaction.  The transaction's blocks are
+// copied to log buffers with begin_op held off, then the open
+// transaction is handed to new operations while the copies go to
+// disk: the log is double-buffered.  Operations that end during
+// the disk writes pile into the next transaction, which this loop
+// commits as one group as soon as they are all done.
+static void
+commit()
+{
+  struct buf **to = log.buf;
+  int from, end;
+  uint txn;
+
+  acquire(&log.lock);
+  for (;;) {
+    log.committing = 1;
+    txn = log.txn++;
+    log.ended = 0;
+    from = log.committed;
+    end = log.cend = log.lh.n;
+    memmove(log.cdata, log.data, log.ndata * sizeof(int));
+    log.ncdata = log.ndata;
+    log.ndata = 0;
+    release(&log.lock);
+    snapshot_log(to, from, end);
     acquire(&log.lock);
     log.committing = 0;
     wakeup(&log);
     release(&log.lock);
+
+    if (log.ncdata > 0)
+      write_data();               // File data first, in place
+    if (end > from) {
+      write_log(to, end - from);  // Write modified blocks to log
+      write_head(end);            // Write header to disk -- the real commit
+    }
+
+    acquire(&log.lock);
+    if (log.committed == 0 && end > 0)
+      log.since = ticks;
+    log.committed = end;
+    log.donetxn = txn;
+    wakeup(&log);
+    if (log.outstanding > 0 || log.ended == 0)
+      break;
   }
+  log.writing = 0;
+  release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
+// Write the cached copies of all logged blocks to their home
+// locations, in block order and as one batch so runs of
+// neighbouring blocks share disk commands, then erase the log.
+// Caller has set log.committing and there are no outstanding
+// operations.
 static void
-write_log(void)
+checkpoint(void)
 {
-  int tail;
+  int i, n;
+  int blocks[LOGSIZE];
+
+  memmove(blocks, log.lh.block, log.committed * sizeof(int));
+  n = sortblocks(blocks, log.committed);  // a block may be logged twice
+  for (i = 0; i < n; i++)
+    log.buf[i] = bread(log.dev, blocks[i]);
+  if (n > 0)
+    bwritev(log.buf, n);  // clears B_DIRTY
+  for (i = 0; i < n; i++)
+    brelse(log.buf[i]);
+  log.lh.n = log.committed = log.cend = 0;
+  write_head(0);
+  memset(log.busy, 0, sizeof(log.busy));
+}
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Checkpoint now, once the running FS system calls finish.
+// Used by sync() and fsync() and by the flusher.
+void
+logsync(void)
+{
+  acquire(&log.lock);
+  log.pressure = 1;
+  while (log.committing || log.writing || log.outstanding > 0)
+    sleep(&log, &log.lock);
+  if (log.committed == 0) {
+    log.pressure = 0;
+    wakeup(&log);
+    release(&log.lock);
+    return;
   }
+  log.committing = 1;
+  release(&log.lock);
+
+  checkpoint();
+
+  acquire(&log.lock);
+  log.committing = 0;
+  log.pressure = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
+// The flusher waits on the clock; wake it early.
 static void
-commit()
+kickflusher(void)
+{
+  acquire(&tickslock);
+  wakeup(&ticks);
+  release(&tickslock);
+}
+
+// Flusher thread: checkpoint the log when the oldest commit in
+// it is LOGFLUSH ticks old or when begin_op needs the space.
+void
+logflusher(void)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
-    log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+  int due;
+
+  for (;;) {
+    acquire(&log.lock);
+    while (log.committed == 0)
+      sleep(&log, &log.lock);  // end_op wakes &log after a commit
+    due = log.pressure || ticks - log.since >= LOGFLUSH;
+    release(&log.lock);
+
+    if (due) {
+      logsync();
+    } else {
+      acquire(&tickslock);
+      sleep(&ticks, &tickslock);
+      release(&tickslock);
+    }
   }
 }
 
@@ -221,7 +501,7 @@ log_write(struct buf *b)
     panic("log_write outside of trans");
 
   acquire(&log.lock);
-  for (i = 0; i < log.lh.n; i++) {
+  for (i = log.cend; i < log.lh.n; i++) {
     if (log.lh.block[i] == b->blockno)   // log absorbtion
       break;
   }
@@ -229,6 +509,78 @@ log_write(struct buf *b)
   if (i == log.lh.n)
     log.lh.n++;
   b->flags |= B_DIRTY; // prevent eviction
+  markbusy(b->blockno);
+  release(&log.lock);
+}
+
+// Like log_write(), for a block of regular file data.  In
+// ordered mode the block is only pinned; commit() writes it in
+// place ahead of the log.
+void
+log_data(struct buf *b)
+{
+  int i;
+
+  acquire(&log.lock);
+  if (!log.ordered || isbusy(b->blockno)) {
+    release(&log.lock);
+    log_write(b);
+    return;
+  }
+  if (log.dataops < 1)
+    panic("log_data outside of data op");
+  for (i = 0; i < log.ndata; i++)
+    if (log.data[i] == b->blockno)
+      break;
+  if (i == log.ndata) {
+    if (log.ndata >= LOGDATA)
+      panic("too much data in transaction");
+    log.data[log.ndata++] = b->blockno;
+  }
+  b->flags |= B_DIRTY; // prevent eviction
+  release(&log.lock);
+}
+
+// Record that block b was freed by the open transaction.
+void
+log_freed(uint b)
+{
+  acquire(&log.lock);
+  markbusy(b);
   release(&log.lock);
 }
 
+// Should balloc pass over free block b for now?
+int
+log_busy(uint b)
+{
+  int r;
+
+  acquire(&log.lock);
+  r = isbusy(b);
+  release(&log.lock);
+  return r;
+}
+
+// Ordered mode: is b freed or logged since the last checkpoint?
+// Caller must hold log.lock.
+static int
+isbusy(uint b)
+{
+  return log.ordered && b < FSSIZE && (log.busy[b/8] & (1 << (b%8)));
+}
+
+static void
+markbusy(uint b)
+{
+  if (log.ordered && b < FSSIZE)
+    log.busy[b/8] |= 1 << (b%8);
+}
+
+// Is the file system mounted in ordered mode?
+int
+log_ordered(void)
+{
+  return log.ordered;
+}
+
@@ -0,0 +1,183 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+// Microbenchmark: size-class malloc (umalloc.c) against the
+// original first-fit K&R allocator, which is kept here as kr_malloc.
+
+#define NLIVE   512    // live blocks in the churn test
+#define ROUNDS  200
+#define NBIG    32     // blocks in the large test
+#define BIGSIZE 65536
+
+typedef long Align;
+
+union krheader {
+  struct {
+    union krheader *ptr;
+    uint size;
+  } s;
+  Align x;
+};
+
+typedef union krheader KRHeader;
+
+static KRHeader krbase;
+static KRHeader *krfreep;
+
+static void
+kr_free(void *ap)
+{
+  KRHeader *bp, *p;
+
+  bp = (KRHeader*)ap - 1;
+  for(p = krfreep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
+    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
+      break;
+  if(bp + bp->s.size == p->s.ptr){
+    bp->s.size += p->s.ptr->s.size;
+    bp->s.ptr = p->s.ptr->s.ptr;
+  } else
+    bp->s.ptr = p->s.ptr;
+  if(p + p->s.size == bp){
+    p->s.size += bp->s.size;
+    p->s.ptr = bp->s.ptr;
+  } else
+    p->s.ptr = bp;
+  krfreep = p;
+}
+
+static KRHeader*
+kr_morecore(uint nu)
+{
+  char *p;
+  KRHeader *hp;
+
+  if(nu < 4096)
+    nu = 4096;
+  p = sbrk(nu * sizeof(KRHeader));
+  if(p == (char*)-1)
+    return 0;
+  hp = (KRHeader*)p;
+  hp->s.size = nu;
+  kr_free((void*)(hp + 1));
+  return krfreep;
+}
+
+static void*
+kr_malloc(uint nbytes)
+{
+  KRHeader *p, *prevp;
+  uint nunits;
+
+  nunits = (nbytes + sizeof(KRHeader) - 1)/sizeof(KRHeader) + 1;
+  if((prevp = krfreep) == 0){
+    krbase.s.ptr = krfreep = prevp = &krbase;
+    krbase.s.size = 0;
+  }
+  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
+    if(p->s.size >= nunits){
+      if(p->s.size == nunits)
+        prevp->s.ptr = p->s.ptr;
+      else {
+        p->s.size -= nunits;
+        p += p->s.size;
+        p->s.size = nunits;
+      }
+      krfreep = prevp;
+      return (void*)(p + 1);
+    }
+    if(p == krfreep)
+      if((p = kr_morecore(nunits)) == 0)
+        return 0;
+  }
+}
+
+struct allocator {
+  char *name;
+  void *(*alloc)(uint);
+  void (*release)(void*);
+};
+
+static struct allocator allocators[] = {
+  { "k&r",       kr_malloc, kr_free },
+  { "sizeclass", malloc,    free },
+};
+
+static uint seed = 1;
+
+static uint
+rand(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 16) & 0x7fff;
+}
+
+static void *live[NLIVE];
+
+// Keep NLIVE random-sized small blocks alive and replace a random
+// one each step, so the free list stays fragmented.
+static int
+churn(struct allocator *a)
+{
+  int i, r, t0;
+
+  seed = 1;
+  for(i = 0; i < NLIVE; i++)
+    live[i] = a->alloc(16 + rand() % 500);
+  t0 = uptime();
+  for(r = 0; r < ROUNDS * NLIVE; r++){
+    i = rand() % NLIVE;
+    a->release(live[i]);
+    if((live[i] = a->alloc(16 + rand() % 500)) == 0){
+      printf(1, "mallocbench: %s: out of memory\n", a->name);
+      exit();
+    }
+  }
+  t0 = uptime() - t0;
+  for(i = 0; i < NLIVE; i++)
+    a->release(live[i]);
+  return t0;
+}
+
+// Allocate and touch a burst of large blocks, then free them all.
+static int
+burst(struct allocator *a)
+{
+  int i, r, t0;
+
+  t0 = uptime();
+  for(r = 0; r < ROUNDS / 10; r++){
+    for(i = 0; i < NBIG; i++){
+      if((live[i] = a->alloc(BIGSIZE)) == 0){
+        printf(1, "mallocbench: %s: out of memory\n", a->name);
+        exit();
+      }
+      memset(live[i], 0, BIGSIZE);
+    }
+    for(i = NBIG - 1; i >= 0; i--)
+      a->release(live[i]);
+  }
+  return uptime() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct allocator *a;
+  char *brk0;
+  int i, t;
+
+  printf(1, "mallocbench: %d live blocks, %d rounds\n", NLIVE, ROUNDS);
+  for(i = 0; i < sizeof(allocators)/sizeof(allocators[0]); i++){
+    a = &allocators[i];
+    brk0 = sbrk(0);
+    t = churn(a);
+    printf(1, "%s: churn %d ticks, ", a->name, t);
+    t = burst(a);
+    printf(1, "burst %d ticks, heap kept %d KB\n", t,
+           (int)(sbrk(0) - brk0) / 1024);
+  }
+  memstats();
+  exit();
+}
@@ -58,3 +58,16 @@ iderw(struct buf *b)
     memmove(b->data, p, BSIZE);
   b->flags |= B_VALID;
 }
+
+// Sync n bufs with disk.
+void
+iderwv(struct buf **bv, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    iderw(bv[i]);
+    if(bv[i]->flags & B_ASYNC)
+      bdone(bv[i]);
+  }
+}
@@ -15,7 +15,6 @@
 #define static_assert(a, b) do { switch (0) case 0: case (a): ; } while (0)
 #endif
 
-#define NINODES 200
 
 // Disk layout:
 // [ boot block | sb block | log | inode blocks | free bit map | data blocks ]
@@ -39,6 +38,7 @@ void winode(uint, struct dinode*);
 void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
+uint iblock(struct dinode *din, uint fbn);
 void iappend(uint inum, void *p, int n);
 
 // convert to intel byte order
@@ -76,8 +76,14 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 1 && strcmp(argv[1], "-o") == 0){
+    // Mount with ordered (metadata-only) journaling.
+    sb.flags = xint(FS_ORDERED);
+    argc--;
+    argv++;
+  }
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-o] fs.img files...\n");
     exit(1);
   }
 
@@ -90,7 +96,7 @@ main(int argc, char *argv[])
     exit(1);
   }
 
-  // 1 fs block = 1 disk sector
+  // 1 fs block = BSIZE/512 disk sectors
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
 
@@ -158,7 +164,8 @@ main(int argc, char *argv[])
   // fix size of root inode dir
   rinode(rootino, &din);
   off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
+  off = ((off + BSIZE - 1)/BSIZE) * BSIZE;
+  assert(off <= DIRLINEAR*BSIZE);  // mkfs does not hash directories
   din.size = xint(off);
   winode(rootino, &din);
 
@@ -252,6 +259,56 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block holding file block fbn of din,
+// allocating it if necessary; the same layout as bmap().
+uint
+iblock(struct dinode *din, uint fbn)
+{
+  struct extent *e;
+  uint i, end, x;
+  uint indirect[NINDIRECT];
+
+  for(i = 0; i < NEXTENT && din->ext[i].len != 0; i++){
+    e = &din->ext[i];
+    if(fbn < xshort(e->off) + xshort(e->len))
+      return xint(e->start) + fbn - xshort(e->off);
+  }
+  e = i > 0 ? &din->ext[i-1] : 0;
+  end = e ? xshort(e->off) + xshort(e->len) : 0;
+  fbn -= end;
+
+  if(din->dindirect == 0 && end < MAXEXTBLK){
+    assert(fbn == 0);
+    if(e && xint(e->start) + xshort(e->len) == freeblock){
+      e->len = xshort(xshort(e->len) + 1);
+      return freeblock++;
+    }
+    if(i < NEXTENT){
+      e = &din->ext[i];
+      e->start = xint(freeblock);
+      e->off = xshort(end);
+      e->len = xshort(1);
+      return freeblock++;
+    }
+  }
+
+  assert(fbn < NDINDIRECT);
+  if(xint(din->dindirect) == 0)
+    din->dindirect = xint(freeblock++);
+  rsect(xint(din->dindirect), (char*)indirect);
+  if(indirect[fbn / NINDIRECT] == 0){
+    indirect[fbn / NINDIRECT] = xint(freeblock++);
+    wsect(xint(din->dindirect), (char*)indirect);
+  }
+  x = xint(indirect[fbn / NINDIRECT]);
+  rsect(x, (char*)indirect);
+  if(indirect[fbn % NINDIRECT] == 0){
+    indirect[fbn % NINDIRECT] = xint(freeblock++);
+    wsect(x, (char*)indirect);
+  }
+  return xint(indirect[fbn % NINDIRECT]);
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -259,7 +316,6 @@ iappend(uint inum, void *xp, int n)
   uint fbn, off, n1;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
   uint x;
 
   rinode(inum, &din);
@@ -268,22 +324,7 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
-      if(xint(din.addrs[fbn]) == 0){
-        din.addrs[fbn] = xint(freeblock++);
-      }
-      x = xint(din.addrs[fbn]);
-    } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
-      }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      }
-      x = xint(indirect[fbn-NDIRECT]);
-    }
+    x = iblock(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
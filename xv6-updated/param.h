@@ -3,12 +3,33 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // initial and minimum size of inode cache
+#define NINODEMAX  2048  // maximum size of inode cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define USTACKMAX (256*4096)  // user stack limit, reserved at exec
+#define PRECOPY_STACK 1  // fork copies the page under the user esp
+#define PRECOPY_DIRTY 2  // fork copies pages dirtied since last fork
+#define FORKPRECOPY  (PRECOPY_STACK|PRECOPY_DIRTY)
+#define PRECOPYMAX    8  // max dirty pages copied per fork
+#define FORK_AUTO     0  // forkmode(): pick by the image's divergence
+#define FORK_COW      1  // forkmode(): share every page copy-on-write
+#define FORK_HYBRID   2  // forkmode(): COW plus the FORKPRECOPY pages
+#define FORK_EAGER    3  // forkmode(): copy every page at fork
+#define NFORKIMG     16  // images whose fork divergence is tracked
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#ifndef LOGSIZE
+#define LOGSIZE      (MAXOPBLOCKS*12)  // max data blocks in on-disk log; < BSIZE/4
+#endif
+#define NBUF         (LOGSIZE*2+MAXOPBLOCKS*3)  // initial and minimum size of disk block cache
+#define NBUFMAX      4096  // maximum size of disk block cache
+#define BPREFETCH    8  // max blocks bprefetch reads in one batch
+#define MAXOPDATA    32  // max file data blocks an FS op writes, ordered mode
+#define LOGDATA      (MAXOPDATA*4)  // file data blocks per transaction, ordered mode
+#define NDCACHE      128  // directory name cache entries
+#define NREADAHEAD   8  // blocks read ahead of a sequential reader
+#define LOGFLUSH     100  // ticks a commit waits for the flusher to install it
+#define FSSIZE       20000 // size of file system in blocks
+#define NINODES      200  // inodes in the file system
 
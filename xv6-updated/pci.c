@@ -0,0 +1,72 @@
+// Minimal PCI bus support: configuration space access through
+// the legacy 0xcf8/0xcfc ports and a scan of bus 0 for a device.
+
+#include "types.h"
+#include "defs.h"
+#include "x86.h"
+#include "pci.h"
+
+static uint
+cfgaddr(struct pcidev *d, uint off)
+{
+  return 0x80000000 | (d->bus << 16) | (d->dev << 11) |
+         (d->func << 8) | (off & 0xfc);
+}
+
+uint
+pciread(struct pcidev *d, uint off)
+{
+  outl(PCI_CFGADDR, cfgaddr(d, off));
+  return inl(PCI_CFGDATA);
+}
+
+void
+pciwrite(struct pcidev *d, uint off, uint v)
+{
+  outl(PCI_CFGADDR, cfgaddr(d, off));
+  outl(PCI_CFGDATA, v);
+}
+
+// Find the first function on bus 0 that matches vendor, device
+// and class/subclass; PCI_ANY matches anything.  Fills in *d and
+// returns 0, or returns -1 if there is no such device.
+int
+pcifind(struct pcidev *d, uint vendor, uint device, uint class, uint subclass)
+{
+  uint id, cl, i;
+
+  d->bus = 0;
+  for(d->dev = 0; d->dev < 32; d->dev++){
+    for(d->func = 0; d->func < 8; d->func++){
+      id = pciread(d, PCI_ID);
+      if((id & 0xffff) == 0xffff){
+        if(d->func == 0)
+          break;
+        continue;
+      }
+      cl = pciread(d, PCI_CLASS);
+      if((vendor == PCI_ANY || vendor == (id & 0xffff)) &&
+         (device == PCI_ANY || device == id >> 16) &&
+         (class == PCI_ANY || class == cl >> 24) &&
+         (subclass == PCI_ANY || subclass == ((cl >> 16) & 0xff))){
+        d->vendor = id & 0xffff;
+        d->device = id >> 16;
+        d->class = cl >> 24;
+        d->subclass = (cl >> 16) & 0xff;
+        d->progif = (cl >> 8) & 0xff;
+        d->irq = pciread(d, PCI_INTR) & 0xff;
+        for(i = 0; i < 6; i++)
+          d->bar[i] = pciread(d, PCI_BAR0 + 4*i);
+        return 0;
+      }
+    }
+  }
+  return -1;
+}
+
+// Turn on the given PCI_CMD_* bits in d's command register.
+void
+pcienable(struct pcidev *d, uint bits)
+{
+  pciwrite(d, PCI_CMD, (pciread(d, PCI_CMD) & 0xffff) | bits);
+}
@@ -0,0 +1,33 @@
+// PCI configuration space.
+
+#define PCI_CFGADDR   0xcf8   // configuration address port
+#define PCI_CFGDATA   0xcfc   // configuration data port
+
+// Configuration header registers (byte offsets).
+#define PCI_ID        0x00    // device id << 16 | vendor id
+#define PCI_CMD       0x04    // status << 16 | command
+#define PCI_CLASS     0x08    // class, subclass, prog-if, revision
+#define PCI_BAR0      0x10    // six base address registers
+#define PCI_INTR      0x3c    // interrupt line (low byte)
+
+// Command register bits.
+#define PCI_CMD_IO      0x1   // respond to I/O space accesses
+#define PCI_CMD_MEM     0x2   // respond to memory space accesses
+#define PCI_CMD_MASTER  0x4   // may act as bus master (DMA)
+
+#define PCI_BAR_IO    0x1     // BAR describes an I/O port range
+
+#define PCI_ANY       0xffff  // pcifind wildcard
+
+struct pcidev {
+  uchar bus;
+  uchar dev;
+  uchar func;
+  ushort vendor;
+  ushort device;
+  uchar class;
+  uchar subclass;
+  uchar progif;
+  uchar irq;
+  uint bar[6];
+};
@@ -12,6 +12,19 @@ struct {
   struct proc proc[NPROC];
 } ptable;
 
+// Post-fork divergence of recently run images: the share of
+// pages shared at fork that the child went on to write.
+struct forkimg {
+  char name[16];
+  int pct;                     // moving average, percent
+  int samples;
+};
+
+struct {
+  struct spinlock lock;
+  struct forkimg img[NFORKIMG];
+} forkstats;
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -24,6 +37,7 @@ void
 pinit(void)
 {
   initlock(&ptable.lock, "ptable");
+  initlock(&forkstats.lock, "forkstats");
 }
 
 // Must be called with interrupts disabled
@@ -115,6 +129,25 @@ found:
   return p;
 }
 
+// Start a kernel thread that runs fn, which must never return.
+// It has no user memory and runs on the kernel page table.
+void
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0 || (p->pgdir = setupkvm()) == 0)
+    panic("kthread");
+
+  // Have forkret return into fn instead of trapret.
+  *(uint*)((char*)p->context + sizeof *p->context) = (uint)fn;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+  p->state = RUNNABLE;
+  release(&ptable.lock);
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -166,14 +199,82 @@ growproc(int n)
     if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
   } else if(n < 0){
+    if(-n > sz)
+      return -1;
     if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
       return -1;
+    curproc->reclaimed_pages +=
+      (PGROUNDUP(curproc->sz) - PGROUNDUP(sz)) / PGSIZE;
   }
   curproc->sz = sz;
   switchuvm(curproc);
   return 0;
 }
 
+// Choose how fork copies p's memory.  Children that end up
+// writing most of their pages are cheaper to copy eagerly than
+// to fault on page by page; children that exec or exit quickly
+// are cheapest with plain COW.
+static int
+forkpolicy(struct proc *p)
+{
+  struct forkimg *f;
+  int mode;
+
+  if(p->forkmode != FORK_AUTO)
+    return p->forkmode;
+  mode = FORK_HYBRID;
+  acquire(&forkstats.lock);
+  for(f = forkstats.img; f < &forkstats.img[NFORKIMG]; f++){
+    if(f->samples == 0 || strncmp(f->name, p->name, sizeof(f->name)) != 0)
+      continue;
+    if(f->pct >= 75)
+      mode = FORK_EAGER;
+    else if(f->pct < 10)
+      mode = FORK_COW;
+    break;
+  }
+  release(&forkstats.lock);
+  return mode;
+}
+
+// Record how far p diverged from its parent since fork.
+// Called when p execs or exits, which ends the sharing.
+void
+forkdiverged(struct proc *p)
+{
+  struct forkimg *f, *victim;
+  int pct;
+
+  if(p->shared_pages == 0)
+    return;
+  p->modified_pages += forkdirty(p->pgdir);
+  pct = p->modified_pages * 100 / p->shared_pages;
+  if(pct > 100)
+    pct = 100;
+  p->shared_pages = 0;
+
+  acquire(&forkstats.lock);
+  victim = forkstats.img;
+  for(f = forkstats.img; f < &forkstats.img[NFORKIMG]; f++){
+    if(f->samples && strncmp(f->name, p->name, sizeof(f->name)) == 0)
+      break;
+    if(f->samples < victim->samples)
+      victim = f;
+  }
+  if(f == &forkstats.img[NFORKIMG]){
+    f = victim;
+    safestrcpy(f->name, p->name, sizeof(f->name));
+    f->samples = 0;
+  }
+  if(f->samples == 0)
+    f->pct = pct;
+  else
+    f->pct = (3*f->pct + pct) / 4;
+  f->samples++;
+  release(&forkstats.lock);
+}
+
 // Create a new process copying p as the parent.
 // Sets up stack to return as if from system call.
 // Caller must set state of returned proc to RUNNABLE.
@@ -189,14 +290,26 @@ fork(void)
     return -1;
   }
 
+  // Copying clears the dirty bits, so fold in the pages this
+  // process wrote since its own fork first.
+  if(curproc->shared_pages > 0)
+    curproc->modified_pages += forkdirty(curproc->pgdir);
+
   // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz, curproc->tf->esp,
+                          forkpolicy(curproc))) == 0){
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
     return -1;
   }
   np->sz = curproc->sz;
+  np->stackbase = curproc->stackbase;
+  np->forkmode = curproc->forkmode;
+  // Pages shared COW plus pages copied up front.  Divergence is
+  // COW faults on the former plus dirty bits on the latter.
+  np->shared_pages = countpages(np->pgdir, 1, 0) + countpages(np->pgdir, 0, 1);
+  np->modified_pages = 0;
   np->parent = curproc;
   *np->tf = *curproc->tf;
 
@@ -214,6 +327,7 @@ fork(void)
   // Track parent info for CMDT
   np->parent_pid = curproc->pid;
   np->fork_time = ticks;
+  np->reclaimed_pages = 0;
 
   acquire(&ptable.lock);
 
@@ -237,6 +351,8 @@ exit(void)
   if(curproc == initproc)
     panic("init exiting");
 
+  forkdiverged(curproc);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
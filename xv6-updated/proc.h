@@ -51,13 +51,16 @@ struct proc {
   char name[16];               // Process name (debugging)
   int parent_pid;              //L-52-56 to implement CMDT
   uint fork_time;
-  int shared_pages;
+  int shared_pages;            // Pages shared or copied from parent at fork
   int private_pages;
-  int modified_pages;
+  int modified_pages;          // Of those, pages written since fork
+  int reclaimed_pages;         // Heap pages returned by negative sbrk
+  uint stackbase;              // Guard page at bottom of stack region
+  int forkmode;                // FORK_AUTO or a forced copyuvm mode
 };
 
 // Process memory is laid out contiguously, low addresses first:
 //   text
 //   original data and bss
-//   fixed-size stack
+//   guard page and stack region, USTACKMAX bytes, grown on demand
 //   expandable heap
@@ -1,6 +1,10 @@
-// Long-term locks for processes
+// Long-term locks for processes.  Held either exclusively
+// (acquiresleep) or shared by any number of readers
+// (acquireshared).
 struct sleeplock {
-  uint locked;       // Is the lock held?
+  uint locked;       // Is the lock held exclusively?
+  int readers;       // Number of shared holders
+  int wwait;         // Waiting for exclusive; new readers hold off
   struct spinlock lk; // spinlock protecting this sleep lock
   
   // For debugging:
@@ -0,0 +1,65 @@
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+
+// Exercise the on-demand user stack: deep recursion and a large
+// stack array must work, and running past USTACKMAX must kill
+// only the offending process.
+
+int
+recurse(int n)
+{
+  volatile char pad[64];
+
+  pad[0] = n;
+  if(n == 0)
+    return 0;
+  return recurse(n - 1) + pad[0];
+}
+
+int
+bigarray(void)
+{
+  volatile char buf[64*1024];
+  int i, sum;
+
+  for(i = 0; i < sizeof(buf); i += 512)
+    buf[i] = i;
+  sum = 0;
+  for(i = 0; i < sizeof(buf); i += 512)
+    sum += buf[i];
+  return sum;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pid;
+
+  printf(1, "\n=== Stack Growth Test ===\n\n");
+
+  printf(1, "Step 1: recursion 5000 deep\n");
+  recurse(5000);
+  memstats();
+
+  printf(1, "Step 2: 64KB array on the stack\n");
+  bigarray();
+  memstats();
+
+  printf(1, "Step 3: child recursing past the %d KB limit\n", USTACKMAX/1024);
+  pid = fork();
+  if(pid < 0){
+    printf(1, "fork failed\n");
+    exit();
+  }
+  if(pid == 0){
+    recurse(USTACKMAX / 64);
+    printf(1, "stacktest: FAILED, child survived\n");
+    exit();
+  }
+  wait();
+
+  printf(1, "\n=== Stack Growth Test Complete ===\n\n");
+  exit();
+}
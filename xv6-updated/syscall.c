@@ -13,6 +13,14 @@
 // library system call function. The saved user %esp points
 // to a saved program counter, and then the first argument.
 
+// Does [addr, addr+n) overlap p's stack guard page?
+static int
+inguard(struct proc *p, uint addr, uint n)
+{
+  return p->stackbase && addr < p->stackbase + PGSIZE &&
+         addr + n > p->stackbase;
+}
+
 // Fetch the int at addr from the current process.
 int
 fetchint(uint addr, int *ip)
@@ -21,6 +29,8 @@ fetchint(uint addr, int *ip)
 
   if(addr >= curproc->sz || addr+4 > curproc->sz)
     return -1;
+  if(inguard(curproc, addr, 4) || touchstack(curproc, addr, 4) < 0)
+    return -1;
   *ip = *(int*)(addr);
   return 0;
 }
@@ -34,11 +44,16 @@ fetchstr(uint addr, char **pp)
   char *s, *ep;
   struct proc *curproc = myproc();
 
-  if(addr >= curproc->sz)
+  if(addr >= curproc->sz || inguard(curproc, addr, 1))
     return -1;
   *pp = (char*)addr;
   ep = (char*)curproc->sz;
+  if(addr < curproc->stackbase)
+    ep = (char*)curproc->stackbase;
   for(s = *pp; s < ep; s++){
+    if((s == *pp || (uint)s % PGSIZE == 0) &&
+       touchstack(curproc, (uint)s, 1) < 0)
+      return -1;
     if(*s == 0)
       return s - *pp;
   }
@@ -65,6 +80,8 @@ argptr(int n, char **pp, int size)
     return -1;
   if(size < 0 || (uint)i >= curproc->sz || (uint)i+size > curproc->sz)
     return -1;
+  if(inguard(curproc, i, size) || touchstack(curproc, i, size) < 0)
+    return -1;
   *pp = (char*)i;
   return 0;
 }
@@ -105,6 +122,11 @@ extern int sys_write(void);
 extern int sys_uptime(void);
 extern int sys_demo(void);
 extern int sys_memstats(void); //extern declaration for memstats
+extern int sys_forkmode(void);
+extern int sys_bstat(void);
+extern int sys_sync(void);
+extern int sys_fsync(void);
+extern int sys_istat(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -130,6 +152,11 @@ static int (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_demo]   sys_demo, //demo
 [SYS_memstats] sys_memstats, //memstats
+[SYS_forkmode] sys_forkmode,
+[SYS_bstat]   sys_bstat,
+[SYS_sync]    sys_sync,
+[SYS_fsync]   sys_fsync,
+[SYS_istat]   sys_istat,
 };
 
 void
@@ -168,6 +195,10 @@ sys_memstats(void)
   cprintf("Private pages:  %d\n", private_pg);
   cprintf("Modified pages: %d\n", modified);
   cprintf("Total pages:    %d\n", shared + private_pg);
+  cprintf("Reclaimed pages: %d\n", p->reclaimed_pages);
+  if(p->shared_pages > 0)
+    cprintf("Diverged:       %d of %d from fork\n",
+            p->modified_pages, p->shared_pages);
   cprintf("\n");
   
   return 0;
@@ -21,4 +21,9 @@
 #define SYS_mkdir  20
 #define SYS_close  21
 #define SYS_demo   22 //added demo
-#define SYS_memstats 23 //added memstats
\ No newline at end of file
+#define SYS_memstats 23 //added memstats
+#define SYS_forkmode 24
+#define SYS_bstat  25
+#define SYS_sync   26
+#define SYS_fsync  27
+#define SYS_istat  28
\ No newline at end of file
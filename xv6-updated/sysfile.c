@@ -15,6 +15,8 @@
 #include "sleeplock.h"
 #include "file.h"
 #include "fcntl.h"
+#include "bstat.h"
+#include "istat.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -218,6 +220,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, (char*)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcenter(dp, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -274,8 +277,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // dp's hash bucket for name is full: undo.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -442,3 +455,51 @@ sys_pipe(void)
   fd[1] = fd1;
   return 0;
 }
+
+int
+sys_bstat(void)
+{
+  char *p;
+  struct bstat st;
+
+  if(argptr(0, &p, sizeof(st)) < 0)
+    return -1;
+  // Snapshot under bcache.lock, then copy out without it: the
+  // user page may be shared copy-on-write.
+  bstat(&st);
+  return copyout(myproc()->pgdir, (uint)p, &st, sizeof(st));
+}
+
+int
+sys_istat(void)
+{
+  char *p;
+  struct istat st;
+
+  if(argptr(0, &p, sizeof(st)) < 0)
+    return -1;
+  istat(&st);  // under icache.lock; copy out without it
+  return copyout(myproc()->pgdir, (uint)p, &st, sizeof(st));
+}
+
+// Write all committed file system changes to their home
+// locations on disk.
+int
+sys_sync(void)
+{
+  logsync();
+  return 0;
+}
+
+// Every write is durable in the log once it returns; fsync also
+// installs it.  The log is not tracked per file, so this is sync.
+int
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  logsync();
+  return 0;
+}
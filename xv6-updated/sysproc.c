@@ -94,4 +94,21 @@ int
 sys_demo(void)
 {
   return 22;
-}
\ No newline at end of file
+}
+
+// Force how this process's forks copy memory (FORK_COW,
+// FORK_HYBRID, FORK_EAGER) or let the kernel choose
+// (FORK_AUTO).  Inherited by children.  Returns the old mode.
+int
+sys_forkmode(void)
+{
+  int mode, old;
+
+  if(argint(0, &mode) < 0)
+    return -1;
+  if(mode < FORK_AUTO || mode > FORK_EAGER)
+    return -1;
+  old = myproc()->forkmode;
+  myproc()->forkmode = mode;
+  return old;
+}
@@ -77,6 +77,18 @@ trap(struct trapframe *tf)
     break;
 
   default:
+    // The virtio disk's interrupt line is only known at run time.
+    if(virtioirq > 0 && tf->trapno == T_IRQ0 + virtioirq){
+      virtiointr();
+      lapiceoi();
+      break;
+    }
+    // Grow the user stack on demand.  System call arguments and
+    // buffers are made resident by touchstack before the kernel
+    // uses them, so the kernel should rarely fault here.
+    if(tf->trapno == T_PGFLT && myproc() &&
+       growstack(myproc(), rcr2()) == 0)
+      break;
     if(myproc() == 0 || (tf->cs&3) == 0){
       cprintf("unexpected trap %d from cpu %d eip %x (cr2=0x%x)\n",
               tf->trapno, cpuid(), tf->eip, rcr2());
@@ -86,7 +98,11 @@ trap(struct trapframe *tf)
     // Handle COW page faults
     if(tf->trapno == T_PGFLT) {
       uint va = rcr2();
-      if(cowhandler(myproc()->pgdir, va) == 0) {
+      int r = cowhandler(myproc()->pgdir, va);
+      if(r >= 0) {
+        // Only pages shared at fork count as divergence.
+        if(r == 1)
+          myproc()->modified_pages++;
         break;
       }
     }
@@ -3,88 +3,256 @@
 #include "user.h"
 #include "param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Segregated size-class memory allocator.
+//
+// Small requests are rounded up to a power-of-two class and served
+// from slabs: runs of equal-sized blocks carved out of one large
+// block.  Each class keeps a list of slabs that still have free
+// blocks, so malloc() and free() are O(1).  Blocks are carved from
+// a slab only as they are first needed, and a slab whose blocks are
+// all free again is released back to the large-block pool.
+//
+// Requests too big for any class go straight to sbrk().  Free large
+// blocks are kept on an address-ordered list so neighbours coalesce,
+// and a free run of at least TRIMSIZE that ends at the break is
+// handed back to the kernel with a negative sbrk().
 
 typedef long Align;
 
 union header {
   struct {
-    union header *ptr;
-    uint size;
+    union header *next;  // free: next free block; small and in use: its slab
+    uint size;           // block size in bytes, header included
   } s;
   Align x;
 };
 
 typedef union header Header;
 
-static Header base;
-static Header *freep;
+struct slab {
+  struct slab *next;     // class list of slabs with free blocks
+  struct slab *prev;
+  Header *free;          // freed blocks in this slab
+  char *top;             // next never-used block
+  char *end;
+  uint live;             // blocks handed out
+  uint cls;
+};
 
-void
-free(void *ap)
+#define MINSHIFT  4                              // smallest class is 16 bytes
+#define NCLASS    8                              // 16, 32, ..., 2048
+#define MAXSMALL  (1 << (MINSHIFT + NCLASS - 1)) // largest class size
+#define SLABSIZE  4096                           // smallest slab, in bytes
+#define TRIMSIZE  (16*4096)                      // free run worth returning
+
+static struct slab *partial[NCLASS];  // slabs with at least one free block
+static Header *bigfree;               // free large blocks, sorted by address
+
+static void *mallocbig(uint);
+static void freebig(Header*);
+
+static int
+sizeclass(uint size)
 {
-  Header *bp, *p;
+  int c;
 
-  bp = (Header*)ap - 1;
-  for(p = freep; !(bp > p && bp < p->s.ptr); p = p->s.ptr)
-    if(p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-      break;
-  if(bp + bp->s.size == p->s.ptr){
-    bp->s.size += p->s.ptr->s.size;
-    bp->s.ptr = p->s.ptr->s.ptr;
-  } else
-    bp->s.ptr = p->s.ptr;
-  if(p + p->s.size == bp){
-    p->s.size += bp->s.size;
-    p->s.ptr = bp->s.ptr;
+  for(c = 0; (1 << (MINSHIFT + c)) < size; c++)
+    ;
+  return c;
+}
+
+static void
+slablink(struct slab *s)
+{
+  s->prev = 0;
+  s->next = partial[s->cls];
+  if(s->next)
+    s->next->prev = s;
+  partial[s->cls] = s;
+}
+
+static void
+slabunlink(struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    partial[s->cls] = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+}
+
+static struct slab*
+newslab(int c)
+{
+  struct slab *s;
+  uint len, sz;
+
+  // At least 16 blocks per slab for the larger classes.
+  sz = 1 << (MINSHIFT + c);
+  len = SLABSIZE;
+  if(16 * sz > len)
+    len = 16 * sz;
+  if((s = mallocbig(len)) == 0)
+    return 0;
+  s->free = 0;
+  s->top = (char*)(s + 1);
+  s->end = (char*)s - sizeof(Header) + len;
+  s->live = 0;
+  s->cls = c;
+  slablink(s);
+  return s;
+}
+
+static int
+slabfull(struct slab *s)
+{
+  return s->free == 0 && s->top + (1 << (MINSHIFT + s->cls)) > s->end;
+}
+
+static void
+freesmall(Header *bp)
+{
+  struct slab *s;
+  int full;
+
+  s = (struct slab*)bp->s.next;
+  full = slabfull(s);
+  bp->s.next = s->free;
+  s->free = bp;
+  if(--s->live == 0){
+    if(!full)
+      slabunlink(s);
+    freebig((Header*)s - 1);
+  } else if(full)
+    slablink(s);
+}
+
+static void
+freebig(Header *bp)
+{
+  Header *p, *prev;
+
+  prev = 0;
+  for(p = bigfree; p && p < bp; prev = p, p = p->s.next)
+    ;
+  if(p && (char*)bp + bp->s.size == (char*)p){
+    bp->s.size += p->s.size;
+    bp->s.next = p->s.next;
   } else
-    p->s.ptr = bp;
-  freep = p;
+    bp->s.next = p;
+  if(prev && (char*)prev + prev->s.size == (char*)bp){
+    prev->s.size += bp->s.size;
+    prev->s.next = bp->s.next;
+    bp = prev;
+  } else if(prev)
+    prev->s.next = bp;
+  else
+    bigfree = bp;
+
+  // Only the last block on the list can end at the break.
+  if(bp->s.next != 0 || bp->s.size < TRIMSIZE)
+    return;
+  if((char*)bp + bp->s.size != sbrk(0))
+    return;
+  if(bigfree == bp)
+    bigfree = 0;
+  else {
+    for(p = bigfree; p->s.next != bp; p = p->s.next)
+      ;
+    p->s.next = 0;
+  }
+  sbrk(-bp->s.size);
 }
 
-static Header*
-morecore(uint nu)
+static void*
+mallocbig(uint size)
 {
-  char *p;
-  Header *hp;
+  Header *p, *prev, *pprev, *rest;
+  char *cp;
+
+  pprev = prev = 0;
+  for(p = bigfree; p; pprev = prev, prev = p, p = p->s.next){
+    if(p->s.size < size)
+      continue;
+    // Hand out the front so the free remainder stays near the break.
+    if(p->s.size - size > MAXSMALL){
+      rest = (Header*)((char*)p + size);
+      rest->s.size = p->s.size - size;
+      rest->s.next = p->s.next;
+      p->s.size = size;
+    } else
+      rest = p->s.next;
+    if(prev)
+      prev->s.next = rest;
+    else
+      bigfree = rest;
+    return (void*)(p + 1);
+  }
+
+  // Extend a free block that ends at the break instead of
+  // leaving it stranded below the new allocation.
+  cp = sbrk(0);
+  if(prev && (char*)prev + prev->s.size == cp){
+    if(sbrk(size - prev->s.size) == (char*)-1)
+      return 0;
+    if(pprev)
+      pprev->s.next = 0;
+    else
+      bigfree = 0;
+    prev->s.size = size;
+    return (void*)(prev + 1);
+  }
 
-  if(nu < 4096)
-    nu = 4096;
-  p = sbrk(nu * sizeof(Header));
-  if(p == (char*)-1)
+  cp = sbrk(size);
+  if(cp == (char*)-1)
     return 0;
-  hp = (Header*)p;
-  hp->s.size = nu;
-  free((void*)(hp + 1));
-  return freep;
+  p = (Header*)cp;
+  p->s.size = size;
+  return (void*)(p + 1);
+}
+
+void
+free(void *ap)
+{
+  Header *bp;
+
+  if(ap == 0)
+    return;
+  bp = (Header*)ap - 1;
+  if(bp->s.size > MAXSMALL)
+    freebig(bp);
+  else
+    freesmall(bp);
 }
 
 void*
 malloc(uint nbytes)
 {
-  Header *p, *prevp;
-  uint nunits;
+  struct slab *s;
+  Header *p;
+  uint size;
+  int c;
 
-  nunits = (nbytes + sizeof(Header) - 1)/sizeof(Header) + 1;
-  if((prevp = freep) == 0){
-    base.s.ptr = freep = prevp = &base;
-    base.s.size = 0;
-  }
-  for(p = prevp->s.ptr; ; prevp = p, p = p->s.ptr){
-    if(p->s.size >= nunits){
-      if(p->s.size == nunits)
-        prevp->s.ptr = p->s.ptr;
-      else {
-        p->s.size -= nunits;
-        p += p->s.size;
-        p->s.size = nunits;
-      }
-      freep = prevp;
-      return (void*)(p + 1);
-    }
-    if(p == freep)
-      if((p = morecore(nunits)) == 0)
-        return 0;
+  size = (nbytes + sizeof(Header) + sizeof(Header) - 1) & ~(sizeof(Header) - 1);
+  if(size < nbytes || size > 0x7fffffff)
+    return 0;
+  if(size > MAXSMALL)
+    return mallocbig(size);
+
+  c = sizeclass(size);
+  if((s = partial[c]) == 0 && (s = newslab(c)) == 0)
+    return 0;
+  if((p = s->free) != 0)
+    s->free = p->s.next;
+  else {
+    p = (Header*)s->top;
+    p->s.size = 1 << (MINSHIFT + c);
+    s->top += p->s.size;
   }
+  s->live++;
+  if(slabfull(s))
+    slabunlink(s);
+  p->s.next = (Header*)s;
+  return (void*)(p + 1);
 }
@@ -1,3 +1,5 @@
+struct bstat;
+struct istat;
 struct stat;
 struct rtcdate;
 
@@ -25,6 +27,11 @@ int sleep(int);
 int uptime(void);
 int demo(void); //demo added
 int memstats(void); //memstats added
+int forkmode(int);
+int bstat(struct bstat*);
+int sync(void);
+int fsync(int);
+int istat(struct istat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -0,0 +1,221 @@
+// Driver for a legacy virtio-blk PCI device, used as disk 1
+// (the file system disk) in place of the IDE slave when QEMU
+// is started with DISK=virtio.
+//
+// Unlike IDE, the device takes many requests at once: each buf
+// becomes a chain of three descriptors (request header, data,
+// status byte) on one virtqueue, and completions come back on
+// the used ring in whatever order the device finishes them.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "pci.h"
+#include "virtio.h"
+
+#define NVRING  256    // largest queue this driver can lay out
+#define SECTOR_SIZE 512
+
+// Per-request state, indexed by the head descriptor of its chain.
+struct vreq {
+  struct virtio_blk_req hdr;
+  uchar status;
+  struct buf *b;
+};
+
+static struct {
+  struct spinlock lock;
+  uint iobase;
+  uint n;                     // queue size, from the device
+  struct vring_desc *desc;
+  struct vring_avail *avail;
+  struct vring_used *used;
+  ushort freedesc;            // free descriptors, chained by next
+  uint nfree;
+  ushort usedidx;             // next used entry to look at
+  struct vreq req[NVRING];
+} vdisk;
+
+int virtioirq;
+
+// The ring must be physically contiguous; the kernel image is.
+static char vring[3*PGSIZE] __attribute__((aligned(PGSIZE)));
+
+// Find and set up the virtio-blk device.
+// Returns 0 on success, -1 if there is none.
+int
+virtioinit(void)
+{
+  struct pcidev pci;
+  uint i, base, n;
+
+  if(pcifind(&pci, VIRTIO_VENDOR, VIRTIO_BLK_DEVICE, PCI_ANY, PCI_ANY) < 0 ||
+     (pci.bar[0] & PCI_BAR_IO) == 0)
+    return -1;
+  pcienable(&pci, PCI_CMD_IO | PCI_CMD_MASTER);
+  base = pci.bar[0] & ~3;
+
+  outb(base + VIRTIO_STATUS, 0);  // reset
+  outb(base + VIRTIO_STATUS, VIRTIO_ACK);
+  outb(base + VIRTIO_STATUS, VIRTIO_ACK | VIRTIO_DRIVER);
+  outl(base + VIRTIO_GUESTFEAT, 0);  // no optional features
+
+  outw(base + VIRTIO_QSEL, 0);
+  n = inw(base + VIRTIO_QSIZE);
+  if(n == 0 || n > NVRING){
+    outb(base + VIRTIO_STATUS, VIRTIO_FAILED);
+    return -1;
+  }
+
+  initlock(&vdisk.lock, "virtio");
+  vdisk.iobase = base;
+  vdisk.n = n;
+  memset(vring, 0, sizeof(vring));
+  vdisk.desc = (struct vring_desc*)vring;
+  vdisk.avail = (struct vring_avail*)(vring + n*sizeof(struct vring_desc));
+  vdisk.used = (struct vring_used*)(vring +
+    PGROUNDUP(n*sizeof(struct vring_desc) + 6 + 2*n));
+  for(i = 0; i < n; i++)
+    vdisk.desc[i].next = i + 1;
+  vdisk.freedesc = 0;
+  vdisk.nfree = n;
+  outl(base + VIRTIO_QADDR, V2P(vring) / VRING_ALIGN);
+
+  virtioirq = pci.irq;
+  ioapicenable(virtioirq, ncpu - 1);
+  outb(base + VIRTIO_STATUS, VIRTIO_ACK | VIRTIO_DRIVER | VIRTIO_DRIVER_OK);
+  return 0;
+}
+
+static ushort
+allocdesc(void)
+{
+  ushort i;
+
+  i = vdisk.freedesc;
+  vdisk.freedesc = vdisk.desc[i].next;
+  vdisk.nfree--;
+  return i;
+}
+
+static void
+freedesc(ushort i)
+{
+  vdisk.desc[i].next = vdisk.freedesc;
+  vdisk.freedesc = i;
+  vdisk.nfree++;
+}
+
+// Tell the device about everything added to the avail ring.
+static void
+kick(void)
+{
+  __sync_synchronize();
+  outw(vdisk.iobase + VIRTIO_QNOTIFY, 0);
+}
+
+// Queue a request for b.  Caller must hold vdisk.lock and have
+// made sure three descriptors are free.
+static void
+submit(struct buf *b)
+{
+  ushort h, d, s;
+  struct vreq *r;
+
+  h = allocdesc();
+  d = allocdesc();
+  s = allocdesc();
+  r = &vdisk.req[h];
+  r->hdr.type = (b->flags & B_DIRTY) ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+  r->hdr.reserved = 0;
+  r->hdr.sector = b->blockno * (BSIZE/SECTOR_SIZE);
+  r->hdr.sectorhi = 0;
+  r->status = 0xff;
+  r->b = b;
+
+  vdisk.desc[h].addr = V2P(&r->hdr);
+  vdisk.desc[h].addrhi = 0;
+  vdisk.desc[h].len = sizeof(r->hdr);
+  vdisk.desc[h].flags = VRING_NEXT;
+  vdisk.desc[h].next = d;
+
+  vdisk.desc[d].addr = V2P(b->data);
+  vdisk.desc[d].addrhi = 0;
+  vdisk.desc[d].len = BSIZE;
+  vdisk.desc[d].flags = VRING_NEXT | ((b->flags & B_DIRTY) ? 0 : VRING_WRITE);
+  vdisk.desc[d].next = s;
+
+  vdisk.desc[s].addr = V2P(&r->status);
+  vdisk.desc[s].addrhi = 0;
+  vdisk.desc[s].len = 1;
+  vdisk.desc[s].flags = VRING_WRITE;
+
+  vdisk.avail->ring[vdisk.avail->idx % vdisk.n] = h;
+  __sync_synchronize();
+  vdisk.avail->idx++;
+}
+
+// Sync n bufs with the virtio disk: all of them are queued
+// before waiting, so the device sees them at once.  Like iderwv,
+// B_ASYNC bufs are not waited for.
+void
+virtiorw(struct buf **bv, int n)
+{
+  int i, async;
+
+  async = bv[0]->flags & B_ASYNC;
+  acquire(&vdisk.lock);
+  for(i = 0; i < n; i++){
+    while(vdisk.nfree < 3){
+      kick();
+      sleep(&vdisk.freedesc, &vdisk.lock);
+    }
+    submit(bv[i]);
+  }
+  kick();
+
+  for(i = 0; i < n && !async; i++)
+    while((bv[i]->flags & (B_VALID|B_DIRTY)) != B_VALID)
+      sleep(bv[i], &vdisk.lock);
+  release(&vdisk.lock);
+}
+
+void
+virtiointr(void)
+{
+  struct vreq *r;
+  struct buf *b;
+  ushort h;
+
+  acquire(&vdisk.lock);
+  inb(vdisk.iobase + VIRTIO_ISR);  // ack the interrupt
+
+  while(vdisk.usedidx != vdisk.used->idx){
+    __sync_synchronize();
+    h = vdisk.used->ring[vdisk.usedidx % vdisk.n].id;
+    r = &vdisk.req[h];
+    if(r->status != 0)
+      panic("virtio: disk error");
+    b = r->b;
+    b->flags |= B_VALID;
+    b->flags &= ~B_DIRTY;
+    if(b->flags & B_ASYNC)
+      bdone(b);
+    else
+      wakeup(b);
+    freedesc(vdisk.desc[vdisk.desc[h].next].next);
+    freedesc(vdisk.desc[h].next);
+    freedesc(h);
+    vdisk.usedidx++;
+  }
+  wakeup(&vdisk.freedesc);
+  release(&vdisk.lock);
+}
@@ -0,0 +1,63 @@
+// Legacy virtio over PCI, and the virtio block device.
+
+// Registers in the I/O space at BAR0.
+#define VIRTIO_FEATURES     0   // device features
+#define VIRTIO_GUESTFEAT    4   // features the driver accepts
+#define VIRTIO_QADDR        8   // page number of the selected queue
+#define VIRTIO_QSIZE        12  // size of the selected queue (16 bits)
+#define VIRTIO_QSEL         14  // select a queue (16 bits)
+#define VIRTIO_QNOTIFY      16  // tell the device a queue has work
+#define VIRTIO_STATUS       18  // device status (8 bits)
+#define VIRTIO_ISR          19  // interrupt status; reading acks
+#define VIRTIO_CONFIG       20  // device-specific configuration
+
+// Device status bits.
+#define VIRTIO_ACK          1
+#define VIRTIO_DRIVER       2
+#define VIRTIO_DRIVER_OK    4
+#define VIRTIO_FAILED       128
+
+#define VIRTIO_VENDOR       0x1af4
+#define VIRTIO_BLK_DEVICE   0x1001  // legacy block device
+
+// Descriptor flags.
+#define VRING_NEXT          1   // chained with the next field
+#define VRING_WRITE         2   // device writes (vs reads)
+
+#define VRING_ALIGN         4096  // used ring starts on a page
+
+struct vring_desc {
+  uint addr;
+  uint addrhi;
+  uint len;
+  ushort flags;
+  ushort next;
+};
+
+struct vring_avail {
+  ushort flags;
+  ushort idx;
+  ushort ring[];
+};
+
+struct vring_used_elem {
+  uint id;     // head of the finished descriptor chain
+  uint len;
+};
+
+struct vring_used {
+  ushort flags;
+  ushort idx;
+  struct vring_used_elem ring[];
+};
+
+// Block request header, the first descriptor of each request.
+#define VIRTIO_BLK_T_IN     0   // read
+#define VIRTIO_BLK_T_OUT    1   // write
+
+struct virtio_blk_req {
+  uint type;
+  uint reserved;
+  uint sector;
+  uint sectorhi;
+};
@@ -271,15 +271,10 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
       if(pa == 0)
         panic("kfree");
       char *v = P2V(pa);
-      
-      // If it's a COW page, just remove the mapping
-      // Don't free the physical page (might be shared)
-      if(*pte & PTE_COW) {
-        *pte = 0;
-      } else {
-        kfree(v);
-        *pte = 0;
-      }
+      // kfree only releases a COW page once no
+      // other process still maps it.
+      kfree(v);
+      *pte = 0;
     }
   }
   return newsz;
@@ -317,26 +312,74 @@ clearpteu(pde_t *pgdir, char *uva)
   *pte &= ~PTE_U;
 }
 
+// Should fork copy this page now rather than share it
+// copy-on-write?  FORK_HYBRID copies the page under the user
+// stack pointer and pages written since the last fork or exec
+// (PTE_D), which are almost certain to be written again.
+static int
+precopy(pte_t *pte, uint va, uint esp, int mode, int *ndirty)
+{
+  if(!(*pte & PTE_U) || !(*pte & (PTE_W|PTE_COW)))
+    return 0;
+  if(mode == FORK_EAGER)
+    return 1;
+  if(mode != FORK_HYBRID)
+    return 0;
+  if((FORKPRECOPY & PRECOPY_STACK) && va == PGROUNDDOWN(esp))
+    return 1;
+  if((FORKPRECOPY & PRECOPY_DIRTY) && (*pte & PTE_D) &&
+     *ndirty < PRECOPYMAX){
+    (*ndirty)++;
+    return 1;
+  }
+  return 0;
+}
+
 // Given a parent process's page table, create a copy
-// of it for a child.
-// Given a parent process's page table, create a copy
-// of it for a child.
-// Given a parent process's page table, create a copy
-// of it for a child.
+// of it for a child.  Pages are shared copy-on-write,
+// except those precopy() picks for the FORK_* mode,
+// which are copied now to spare a fault after fork.
+// esp is the parent's user stack pointer.
 pde_t*
-copyuvm(pde_t *pgdir, uint sz)
+copyuvm(pde_t *pgdir, uint sz, uint esp, int mode)
 {
   pde_t *d;
   pte_t *pte;
   uint pa, i, flags;
+  char *mem;
+  int ndirty;
 
   if((d = setupkvm()) == 0)
     return 0;
+  ndirty = 0;
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0)
-      panic("copyuvm: pte should exist");
+    // The stack region is only mapped where it has been touched.
+    if((pte = walkpgdir(pgdir, (void *) i, 0)) == 0){
+      i = PGADDR(PDX(i) + 1, 0, 0) - PGSIZE;
+      continue;
+    }
     if(!(*pte & PTE_P))
-      panic("copyuvm: page not present");
+      continue;
+
+    if(precopy(pte, i, esp, mode, &ndirty)){
+      // Take the parent's page back from an earlier fork first.
+      if((*pte & PTE_COW) && cowhandler(pgdir, i) < 0)
+        goto bad;
+      *pte &= ~PTE_D;
+      pa = PTE_ADDR(*pte);
+      flags = PTE_FLAGS(*pte);
+      if((mem = kalloc()) == 0)
+        goto bad;
+      memmove(mem, (char*)P2V(pa), PGSIZE);
+      if(mappages(d, (void*)i, PGSIZE, V2P(mem), flags|PTE_FORKED) < 0){
+        kfree(mem);
+        goto bad;
+      }
+      continue;
+    }
+
+    // Start a new dirty interval for the next fork.
+    *pte &= ~PTE_D;
     pa = PTE_ADDR(*pte);
     flags = PTE_FLAGS(*pte);
     
@@ -346,16 +389,23 @@ copyuvm(pde_t *pgdir, uint sz)
       flags = (flags & ~PTE_W) | PTE_COW;
       *pte = pa | flags;
     }
+    if(flags & PTE_COW)
+      flags |= PTE_FORKED;
+    else
+      flags &= ~PTE_FORKED;
     
-    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0) {
-      freevm(d);
-      return 0;
-    }
+    if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0)
+      goto bad;
+    krefpage(P2V(pa));
   }
   
   lcr3(V2P(pgdir)); // Flush TLB
   return d;
 
+bad:
+  lcr3(V2P(pgdir));
+  freevm(d);
+  return 0;
 }
 
 //PAGEBREAK!
@@ -482,6 +532,8 @@ getmemstats(struct proc *p, int *shared, int *private_pg, int *modified)
 // Handle Copy-On-Write page fault
 // Handle Copy-On-Write page fault
 // Handle Copy-On-Write page fault
+// Returns 1 if the page was shared at the last fork, 0 if not,
+// -1 if va is not a COW page or memory is exhausted.
 int
 cowhandler(pde_t *pgdir, uint va)
 {
@@ -489,6 +541,7 @@ cowhandler(pde_t *pgdir, uint va)
   uint pa;
   uint flags;
   char *mem;
+  int forked;
   
   if(va >= KERNBASE)
     return -1;
@@ -505,8 +558,19 @@ cowhandler(pde_t *pgdir, uint va)
   if(!(*pte & PTE_COW))
     return -1;
     
-  // Get physical address and allocate new page
   pa = PTE_ADDR(*pte);
+  flags = PTE_FLAGS(*pte);
+  forked = (flags & PTE_FORKED) != 0;
+  flags = (flags & ~(PTE_COW|PTE_FORKED)) | PTE_W;
+
+  // Last process mapping the page: take it over in place
+  if(kgetrefcount(P2V(pa)) == 1) {
+    *pte = pa | flags;
+    lcr3(V2P(pgdir));
+    return forked;
+  }
+
+  // Get physical address and allocate new page
   mem = kalloc();
   if(mem == 0)
     return -1;
@@ -515,11 +579,90 @@ cowhandler(pde_t *pgdir, uint va)
   memmove(mem, (char*)P2V(pa), PGSIZE);
   
   // Update PTE: make it writable, remove COW flag
-  flags = PTE_FLAGS(*pte);
-  flags = (flags & ~PTE_COW) | PTE_W;
   *pte = V2P(mem) | flags;
+  kfree(P2V(pa));
   
   lcr3(V2P(pgdir)); // Flush TLB
   
+  return forked;
+}
+
+// Count the pages copied from the parent at fork that have been
+// written since, and stop tracking them.  COW faults on shared
+// pages are counted as they happen, in trap().
+int
+forkdirty(pde_t *pgdir)
+{
+  pde_t *pde;
+  pte_t *pgtab;
+  uint i, j;
+  int n;
+
+  n = 0;
+  for(i = 0; i < NPDENTRIES && i < (KERNBASE >> PDXSHIFT); i++){
+    pde = &pgdir[i];
+    if(!(*pde & PTE_P))
+      continue;
+    pgtab = (pte_t*)P2V(PTE_ADDR(*pde));
+    for(j = 0; j < NPTENTRIES; j++){
+      if((pgtab[j] & (PTE_P|PTE_FORKED|PTE_COW|PTE_D)) ==
+         (PTE_P|PTE_FORKED|PTE_D)){
+        pgtab[j] &= ~PTE_FORKED;
+        n++;
+      }
+    }
+  }
+  return n;
+}
+
+// Map a zeroed page at va if va lies in p's stack region, above
+// the guard page, and is not yet resident.  Returns 0 if the page
+// was mapped, -1 if the stack may not grow there or memory is
+// exhausted.
+int
+growstack(struct proc *p, uint va)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(p->stackbase == 0 || va < p->stackbase + PGSIZE ||
+     va >= p->stackbase + USTACKMAX || va >= p->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walkpgdir(p->pgdir, (char*)va, 0);
+  if(pte && (*pte & PTE_P))
+    return -1;
+  if((mem = kalloc()) == 0)
+    return -1;
+  memset(mem, 0, PGSIZE);
+  if(mappages(p->pgdir, (char*)va, PGSIZE, V2P(mem), PTE_W|PTE_U) < 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Make the stack pages covering [va, va+n) resident before the
+// kernel touches them, so that running out of memory fails the
+// system call instead of faulting in kernel mode.
+int
+touchstack(struct proc *p, uint va, uint n)
+{
+  uint a, last;
+  pte_t *pte;
+
+  if(n == 0 || p->stackbase == 0)
+    return 0;
+  a = PGROUNDDOWN(va);
+  last = PGROUNDDOWN(va + n - 1);
+  for(;; a += PGSIZE){
+    if(a >= p->stackbase + PGSIZE && a < p->stackbase + USTACKMAX){
+      pte = walkpgdir(p->pgdir, (char*)a, 0);
+      if((pte == 0 || (*pte & PTE_P) == 0) && growstack(p, a) < 0)
+        return -1;
+    }
+    if(a == last)
+      break;
+  }
   return 0;
-}
\ No newline at end of file
+}